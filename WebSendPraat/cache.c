@@ -0,0 +1,835 @@
+//
+//  cache.c
+//  WebSendPraat
+//
+//  Persistent cache of downloaded files, so that the same URL doesn't have to be
+//  transferred again every time it's opened.
+//
+//  Each entry has its own directory; the sizes and last use of all the entries are also
+//  kept in a memory-mapped index, so that the least recently used entries can be evicted
+//  when the cache grows past its quota, without having to scan the whole cache.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#include "cache.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#if defined (macintosh) || defined (__MACH__)
+#include <sys/clonefile.h>
+#elif defined (__linux__)
+#include <linux/fs.h>
+#endif
+
+static char* cacheDir = NULL;
+static pthread_once_t cacheDirInitialized = PTHREAD_ONCE_INIT;
+
+/* name of the file in each entry's directory that records what we know about the entry */
+static const char* ENTRY_FILE = ".entry";
+
+/* name of the index file in the cache directory */
+static const char* INDEX_FILE = "index";
+
+/* maximum size of the cache in megabytes, unless $WEBSENDPRAAT_CACHE_SIZE says otherwise */
+#define DEFAULT_QUOTA_MB 1024
+
+/* entries used more recently than this are never evicted, as they may be about to be opened */
+#define EVICTION_GRACE_SECONDS 300
+
+/* number of records there's room for in a new index file */
+#define INDEX_INITIAL_CAPACITY 256
+
+/* one entry in the index file */
+typedef struct {
+    uint64_t key;           /* hash of the normalized URL, i.e. the entry's directory name */
+    int64_t size;           /* size of the local copy */
+    int64_t lastUsed;       /* when the entry was last downloaded or opened */
+    uint64_t contentHash;   /* content hash of the local copy, so entries with the same content can be found */
+    uint32_t uses;          /* how many times it has been downloaded or opened */
+    uint32_t reserved;
+} IndexRecord;
+
+/* the start of the index file, which is followed by the records */
+typedef struct {
+    char magic[8];
+    uint32_t capacity;      /* number of records there's room for */
+    uint32_t count;         /* number of records in use, which come first */
+    int64_t totalSize;      /* sum of the records' sizes */
+    int64_t reserved;
+} IndexHeader;
+
+#define INDEX_RECORDS(header) ((IndexRecord*)((header) + 1))
+
+static const char INDEX_MAGIC[8] = "WSPIDX2";
+static int indexFd = -1;
+static IndexHeader* indexMap = NULL;
+static size_t indexMapSize = 0;
+static pthread_mutex_t indexLock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t evictionLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t evictionWanted = PTHREAD_COND_INITIALIZER;
+static int evictionPending = 0;
+static int evictionThreadStarted = 0;
+static pthread_t evictionThread;
+
+static int readEntryFile(const char* fileName, CacheEntry* entry);
+static void indexRecordUse(const char* key, long long size, unsigned long long contentHash);
+static void deduplicate(CacheEntry* entry);
+static void indexRemove(const char* key);
+static void evictInBackground(void);
+
+/* creates the given directory, and any missing parents */
+static int makeDirectories(const char* path) {
+    char partial[CACHE_MAX_PATH];
+    strncpy(partial, path, CACHE_MAX_PATH - 1);
+    partial[CACHE_MAX_PATH - 1] = '\0';
+    for (char* slash = strchr(partial + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(partial, 0700) != 0 && errno != EEXIST) return -1;
+        *slash = '/';
+    }
+    if (mkdir(partial, 0700) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+/* works out where the cache is, and creates it if necessary - called once */
+static void initCacheDirectory(void) {
+    cacheDir = malloc(CACHE_MAX_PATH);
+    const char* override = getenv("WEBSENDPRAAT_CACHE");
+    const char* home = getenv("HOME");
+    if (override && *override) {
+        snprintf(cacheDir, CACHE_MAX_PATH, "%s", override);
+    } else if (!home) {
+        snprintf(cacheDir, CACHE_MAX_PATH, "/tmp/websendpraat-%d", (int)getuid());
+    } else {
+#if defined (macintosh) || defined (__MACH__)
+        snprintf(cacheDir, CACHE_MAX_PATH, "%s/Library/Caches/websendpraat", home);
+#else
+        const char* xdg = getenv("XDG_CACHE_HOME");
+        if (xdg && *xdg) {
+            snprintf(cacheDir, CACHE_MAX_PATH, "%s/websendpraat", xdg);
+        } else {
+            snprintf(cacheDir, CACHE_MAX_PATH, "%s/.cache/websendpraat", home);
+        }
+#endif
+    }
+    if (makeDirectories(cacheDir) != 0) {
+        fprintf(stderr, "Could not create cache directory: %s\n", cacheDir);
+    }
+}
+
+/*
+ * Returns the directory downloaded files are cached in, creating it if necessary.
+ */
+const char* cacheDirectory(void) {
+    pthread_once(&cacheDirInitialized, initCacheDirectory);
+    return cacheDir;
+}
+
+/*
+ * Normalizes the given URL - lowercases the scheme and host, drops default ports
+ * and fragments (other than time ranges) - so that equivalent URLs share a cache entry.
+ */
+char* cacheNormalizeUrl(const char* url) {
+    char* normalized = malloc(strlen(url) + 1);
+    const char* authority = strstr(url, "://");
+    if (!authority) {
+        strcpy(normalized, url);
+    } else {
+        authority += 3;
+        // scheme and host are case-insensitive
+        const char* pathStart = authority + strcspn(authority, "/?#");
+        char* out = normalized;
+        for (const char* c = url; c < pathStart; c++) *out++ = tolower(*c);
+        *out = '\0';
+        // drop default ports
+        size_t length = out - normalized;
+        if (length > 3 && strncmp(normalized, "http://", 7) == 0
+            && strcmp(normalized + length - 3, ":80") == 0) {
+            out -= 3;
+        } else if (length > 4 && strncmp(normalized, "https://", 8) == 0
+                   && strcmp(normalized + length - 4, ":443") == 0) {
+            out -= 4;
+        }
+        // the rest of the URL is case-sensitive, but the fragment is never sent to the server
+        // - unless it's a media fragment time range, in which case we only download part of the file
+        size_t rest = strstr(pathStart, "#t=") ? strlen(pathStart) : strcspn(pathStart, "#");
+        strncpy(out, pathStart, rest);
+        out[rest] = '\0';
+    }
+    return normalized;
+}
+
+/*
+ * Incrementally hashes the given bytes (64-bit FNV-1a).
+ */
+unsigned long long cacheHash(unsigned long long hash, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+#define XXH_PRIME1 0x9e3779b185ebca87ULL
+#define XXH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define XXH_PRIME3 0x165667b19e3779f9ULL
+#define XXH_PRIME4 0x85ebca77c2b2ae63ULL
+#define XXH_PRIME5 0x27d4eb2f165667c5ULL
+
+static uint64_t rotateLeft64(uint64_t x, int n) {
+    return (x << n) | (x >> (64 - n));
+}
+
+/* reads a little-endian 64-bit number */
+static uint64_t read64(const unsigned char* bytes) {
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--) value = (value << 8) | bytes[i];
+    return value;
+}
+
+/* mixes 8 bytes into one of the content hash's lanes */
+static uint64_t hashRound(uint64_t lane, uint64_t input) {
+    lane += input * XXH_PRIME2;
+    return rotateLeft64(lane, 31) * XXH_PRIME1;
+}
+
+/* folds a lane into the final content hash */
+static uint64_t hashMerge(uint64_t hash, uint64_t lane) {
+    hash ^= hashRound(0, lane);
+    return hash * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/*
+ * Starts computing a content hash.
+ */
+void cacheHasherStart(CacheHasher* hasher) {
+    memset(hasher, 0, sizeof(CacheHasher));
+    hasher->lanes[0] = XXH_PRIME1 + XXH_PRIME2;
+    hasher->lanes[1] = XXH_PRIME2;
+    hasher->lanes[2] = 0;
+    hasher->lanes[3] = 0 - XXH_PRIME1;
+}
+
+/* mixes a 32-byte stripe into the lanes */
+static void hashStripe(unsigned long long* lanes, const unsigned char* stripe) {
+    lanes[0] = hashRound(lanes[0], read64(stripe));
+    lanes[1] = hashRound(lanes[1], read64(stripe + 8));
+    lanes[2] = hashRound(lanes[2], read64(stripe + 16));
+    lanes[3] = hashRound(lanes[3], read64(stripe + 24));
+}
+
+/*
+ * Adds the given bytes to the content hash.
+ */
+void cacheHasherUpdate(CacheHasher* hasher, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    hasher->length += length;
+    if (hasher->buffered > 0) { // fill up the incomplete stripe first
+        size_t count = sizeof(hasher->buffer) - hasher->buffered;
+        if (count > length) count = length;
+        memcpy(hasher->buffer + hasher->buffered, bytes, count);
+        hasher->buffered += count;
+        bytes += count;
+        length -= count;
+        if (hasher->buffered < sizeof(hasher->buffer)) return;
+        hashStripe(hasher->lanes, hasher->buffer);
+        hasher->buffered = 0;
+    }
+    // keep the lanes in locals so the compiler can interleave them
+    unsigned long long lanes[4] = { hasher->lanes[0], hasher->lanes[1], hasher->lanes[2], hasher->lanes[3] };
+    for (; length >= 32; bytes += 32, length -= 32) hashStripe(lanes, bytes);
+    memcpy(hasher->lanes, lanes, sizeof(lanes));
+    memcpy(hasher->buffer, bytes, length);
+    hasher->buffered = length;
+}
+
+/*
+ * Returns the hash of all the bytes added so far.
+ */
+unsigned long long cacheHasherFinish(const CacheHasher* hasher) {
+    uint64_t hash;
+    if (hasher->length >= 32) {
+        const unsigned long long* lanes = hasher->lanes;
+        hash = rotateLeft64(lanes[0], 1) + rotateLeft64(lanes[1], 7)
+            + rotateLeft64(lanes[2], 12) + rotateLeft64(lanes[3], 18);
+        for (int l = 0; l < 4; l++) hash = hashMerge(hash, lanes[l]);
+    } else {
+        hash = XXH_PRIME5;
+    }
+    hash += hasher->length;
+    
+    // the bytes that didn't make up a whole stripe
+    const unsigned char* bytes = hasher->buffer;
+    size_t remaining = hasher->buffered;
+    for (; remaining >= 8; bytes += 8, remaining -= 8) {
+        hash ^= hashRound(0, read64(bytes));
+        hash = rotateLeft64(hash, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (remaining >= 4) {
+        uint64_t word = (uint64_t)bytes[0] | ((uint64_t)bytes[1] << 8)
+            | ((uint64_t)bytes[2] << 16) | ((uint64_t)bytes[3] << 24);
+        hash ^= word * XXH_PRIME1;
+        hash = rotateLeft64(hash, 23) * XXH_PRIME2 + XXH_PRIME3;
+        bytes += 4;
+        remaining -= 4;
+    }
+    for (; remaining > 0; bytes++, remaining--) {
+        hash ^= *bytes * XXH_PRIME5;
+        hash = rotateLeft64(hash, 11) * XXH_PRIME1;
+    }
+    
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/*
+ * Adds the content of the given file to the content hash.
+ */
+int cacheHasherAddFile(CacheHasher* hasher, const char* fileName) {
+    FILE* file = fopen(fileName, "rb");
+    if (!file) return -1;
+    unsigned char buffer[65536];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0) cacheHasherUpdate(hasher, buffer, count);
+    int result = ferror(file) ? -1 : 0;
+    fclose(file);
+    return result;
+}
+
+/* fills in entry->key and entry->url for the given URL */
+static void entryKey(const char* url, CacheEntry* entry) {
+    char* normalized = cacheNormalizeUrl(url);
+    snprintf(entry->url, CACHE_MAX_PATH, "%s", normalized);
+    snprintf(entry->key, sizeof(entry->key), "%016llx",
+             cacheHash(CACHE_HASH_INIT, normalized, strlen(normalized)));
+    free(normalized);
+}
+
+/*
+ * Fills in entry->key and entry->url for the given URL, and returns the
+ * directory for the entry (creating it if necessary), which the caller must free.
+ */
+char* cacheEntryDirectory(const char* url, CacheEntry* entry) {
+    entryKey(url, entry);
+    char* directory = malloc(CACHE_MAX_PATH);
+    snprintf(directory, CACHE_MAX_PATH, "%s/%s", cacheDirectory(), entry->key);
+    if (makeDirectories(directory) != 0) {
+        fprintf(stderr, "Could not create cache directory: %s\n", directory);
+    }
+    // make sure it's not evicted while it's being downloaded into
+    indexRecordUse(entry->key, -1, 0);
+    return directory;
+}
+
+/* returns the name of the given entry's index file, which the caller must free */
+static char* entryFileName(const CacheEntry* entry) {
+    char* fileName = malloc(CACHE_MAX_PATH);
+    snprintf(fileName, CACHE_MAX_PATH, "%s/%s/%s", cacheDirectory(), entry->key, ENTRY_FILE);
+    return fileName;
+}
+
+/* reads one "name: value" line into the corresponding entry field */
+static void readEntryLine(CacheEntry* entry, char* line) {
+    char* newline = strpbrk(line, "\r\n");
+    if (newline) *newline = '\0';
+    char* value = strstr(line, ": ");
+    if (!value) return;
+    *value = '\0';
+    value += 2;
+    if (strcmp(line, "url") == 0) {
+        snprintf(entry->url, sizeof(entry->url), "%s", value);
+    } else if (strcmp(line, "path") == 0) {
+        snprintf(entry->path, sizeof(entry->path), "%s", value);
+    } else if (strcmp(line, "etag") == 0) {
+        snprintf(entry->etag, sizeof(entry->etag), "%s", value);
+    } else if (strcmp(line, "last-modified") == 0) {
+        snprintf(entry->lastModified, sizeof(entry->lastModified), "%s", value);
+    } else if (strcmp(line, "size") == 0) {
+        entry->size = atoll(value);
+    } else if (strcmp(line, "mtime") == 0) {
+        entry->mtime = atoll(value);
+    } else if (strcmp(line, "hash") == 0) {
+        entry->contentHash = strtoull(value, NULL, 16);
+    }
+}
+
+/* reads the given entry file - returns 0 on success */
+static int readEntryFile(const char* fileName, CacheEntry* entry) {
+    FILE* file = fopen(fileName, "r");
+    if (!file) return -1;
+    char line[CACHE_MAX_PATH + 32];
+    while (fgets(line, sizeof(line), file)) readEntryLine(entry, line);
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Looks up the given URL in the cache.
+ * Returns 1 if there is an entry and the local copy hasn't changed since it was downloaded,
+ * or 0 otherwise.
+ */
+int cacheLookup(const char* url, CacheEntry* entry) {
+    memset(entry, 0, sizeof(CacheEntry));
+    entryKey(url, entry);
+    char normalizedUrl[CACHE_MAX_PATH];
+    strcpy(normalizedUrl, entry->url);
+    char* fileName = entryFileName(entry);
+    int result = readEntryFile(fileName, entry);
+    free(fileName);
+    if (result != 0) return 0;
+
+    if (strcmp(normalizedUrl, entry->url) != 0) { // hash collision
+        char key[sizeof(entry->key)];
+        strcpy(key, entry->key);
+        memset(entry, 0, sizeof(CacheEntry));
+        strcpy(entry->key, key);
+        strcpy(entry->url, normalizedUrl);
+        return 0;
+    }
+    if (!*entry->path) return 0;
+
+    // if Praat (or anything else) has written to the file since, it's no longer the server's version
+    struct stat status;
+    if (stat(entry->path, &status) != 0) return 0;
+    if (status.st_size != entry->size || (long long)status.st_mtime != entry->mtime) {
+        fprintf(stderr, "Cached file has changed: %s\n", entry->path);
+        return 0;
+    }
+    indexRecordUse(entry->key, entry->size, entry->contentHash);
+    return 1;
+}
+
+/*
+ * Records the given entry in the cache index, after its content has been saved to entry->path.
+ */
+int cacheStore(CacheEntry* entry) {
+    deduplicate(entry);
+    struct stat status;
+    if (stat(entry->path, &status) != 0) return -1;
+    entry->size = status.st_size;
+    entry->mtime = status.st_mtime;
+
+    // write to a temporary file and rename, so that readers never see a partial entry
+    char* fileName = entryFileName(entry);
+    char tempFileName[CACHE_MAX_PATH + 8];
+    snprintf(tempFileName, sizeof(tempFileName), "%s.new", fileName);
+    FILE* file = fopen(tempFileName, "w");
+    if (!file) {
+        fprintf(stderr, "Could not write cache entry: %s\n", tempFileName);
+        free(fileName);
+        return -1;
+    }
+    fprintf(file, "url: %s\n", entry->url);
+    fprintf(file, "path: %s\n", entry->path);
+    if (*entry->etag) fprintf(file, "etag: %s\n", entry->etag);
+    if (*entry->lastModified) fprintf(file, "last-modified: %s\n", entry->lastModified);
+    fprintf(file, "size: %lld\n", entry->size);
+    fprintf(file, "mtime: %lld\n", entry->mtime);
+    fprintf(file, "hash: %016llx\n", entry->contentHash);
+    fclose(file);
+    int result = rename(tempFileName, fileName);
+    free(fileName);
+    if (result == 0) {
+        indexRecordUse(entry->key, entry->size, entry->contentHash);
+        evictInBackground();
+    }
+    return result;
+}
+
+/*
+ * Removes the given URL's entry from the cache, including the local copy.
+ */
+void cacheRemove(const char* url) {
+    CacheEntry entry;
+    cacheLookup(url, &entry);
+    if (*entry.path) remove(entry.path);
+    char* fileName = entryFileName(&entry);
+    remove(fileName);
+    free(fileName);
+    char directory[CACHE_MAX_PATH];
+    snprintf(directory, CACHE_MAX_PATH, "%s/%s", cacheDirectory(), entry.key);
+    rmdir(directory);
+    indexRemove(entry.key);
+}
+
+/* returns the name of the file that records what's known about the given partial download */
+static char* partialFileName(const char* fileName) {
+    char* partialName = malloc(strlen(fileName) + 9);
+    sprintf(partialName, "%s.partial", fileName);
+    return partialName;
+}
+
+/*
+ * Reads what's known about the partial download in the given file.
+ * Returns 1 if the download can be resumed, in which case the file is truncated to
+ * partial->size bytes, or 0 otherwise.
+ */
+int cacheLoadPartial(const char* fileName, CachePartial* partial) {
+    memset(partial, 0, sizeof(CachePartial));
+    char* partialName = partialFileName(fileName);
+    FILE* file = fopen(partialName, "r");
+    free(partialName);
+    if (!file) return 0;
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        char* newline = strpbrk(line, "\r\n");
+        if (newline) *newline = '\0';
+        char* value = strstr(line, ": ");
+        if (!value) continue;
+        *value = '\0';
+        value += 2;
+        if (strcmp(line, "etag") == 0) {
+            snprintf(partial->etag, sizeof(partial->etag), "%s", value);
+        } else if (strcmp(line, "last-modified") == 0) {
+            snprintf(partial->lastModified, sizeof(partial->lastModified), "%s", value);
+        } else if (strcmp(line, "size") == 0) {
+            partial->size = atoll(value);
+        }
+    }
+    fclose(file);
+    
+    // anything written after the partial download was recorded might be incomplete
+    struct stat status;
+    if (partial->size <= 0 || (!*partial->etag && !*partial->lastModified)
+        || stat(fileName, &status) != 0 || status.st_size < partial->size
+        || truncate(fileName, partial->size) != 0) {
+        cacheDiscardPartial(fileName);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Records what's known about the partial download in the given file.
+ */
+int cacheSavePartial(const char* fileName, const CachePartial* partial) {
+    char* partialName = partialFileName(fileName);
+    FILE* file = fopen(partialName, "w");
+    free(partialName);
+    if (!file) return -1;
+    if (*partial->etag) fprintf(file, "etag: %s\n", partial->etag);
+    if (*partial->lastModified) fprintf(file, "last-modified: %s\n", partial->lastModified);
+    fprintf(file, "size: %lld\n", partial->size);
+    return fclose(file);
+}
+
+/*
+ * Deletes the given partial download file, and what's known about it.
+ */
+void cacheDiscardPartial(const char* fileName) {
+    remove(fileName);
+    char* partialName = partialFileName(fileName);
+    remove(partialName);
+    free(partialName);
+}
+
+/* maps the index file into memory, first growing the file if it has room for fewer than the given
+ * number of records - must hold the index lock */
+static int mapIndex(uint32_t capacity) {
+    struct stat status;
+    if (fstat(indexFd, &status) != 0) return -1;
+    size_t size = sizeof(IndexHeader) + (size_t)capacity * sizeof(IndexRecord);
+    if ((size_t)status.st_size < size) {
+        if (ftruncate(indexFd, (off_t)size) != 0) return -1;
+    } else {
+        size = (size_t)status.st_size; // another process may have grown it
+    }
+    if (indexMap && indexMapSize == size) return 0;
+    if (indexMap) munmap(indexMap, indexMapSize);
+    indexMap = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, indexFd, 0);
+    if (indexMap == MAP_FAILED) {
+        indexMap = NULL;
+        indexMapSize = 0;
+        return -1;
+    }
+    indexMapSize = size;
+    if (memcmp(indexMap->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0) {
+        indexMap->capacity = (uint32_t)((size - sizeof(IndexHeader)) / sizeof(IndexRecord));
+    }
+    return 0;
+}
+
+/* returns the given key's record, or NULL if it has none - must hold the index lock */
+static IndexRecord* findRecord(uint64_t key) {
+    IndexRecord* records = INDEX_RECORDS(indexMap);
+    for (uint32_t r = 0; r < indexMap->count; r++) {
+        if (records[r].key == key) return &records[r];
+    }
+    return NULL;
+}
+
+/* returns the given key's record, adding it if necessary - must hold the index lock */
+static IndexRecord* putRecord(uint64_t key) {
+    IndexRecord* record = findRecord(key);
+    if (record) return record;
+    if (indexMap->count == indexMap->capacity && mapIndex(indexMap->capacity * 2) != 0) {
+        fprintf(stderr, "Could not grow cache index\n");
+        return NULL;
+    }
+    record = &INDEX_RECORDS(indexMap)[indexMap->count++];
+    memset(record, 0, sizeof(IndexRecord));
+    record->key = key;
+    return record;
+}
+
+/* removes the given key's record - must hold the index lock */
+static void removeRecord(uint64_t key) {
+    IndexRecord* record = findRecord(key);
+    if (!record) return;
+    indexMap->totalSize -= record->size;
+    // keep the records contiguous by moving the last one into the gap
+    *record = INDEX_RECORDS(indexMap)[--indexMap->count];
+}
+
+/* recreates the index from the entries in the cache directory - must hold the index lock */
+static void rebuildIndex(void) {
+    memset(indexMap, 0, sizeof(IndexHeader));
+    memcpy(indexMap->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    indexMap->capacity = (uint32_t)((indexMapSize - sizeof(IndexHeader)) / sizeof(IndexRecord));
+    DIR* directory = opendir(cacheDirectory());
+    if (!directory) return;
+    struct dirent* child;
+    while ((child = readdir(directory))) {
+        if (strlen(child->d_name) != 16 || strspn(child->d_name, "0123456789abcdef") != 16) continue;
+        char fileName[CACHE_MAX_PATH];
+        if (snprintf(fileName, sizeof(fileName), "%s/%s/%s", cacheDirectory(), child->d_name, ENTRY_FILE) >= (int)sizeof(fileName)) continue;
+        struct stat status;
+        CacheEntry entry;
+        memset(&entry, 0, sizeof(CacheEntry));
+        if (stat(fileName, &status) != 0 || readEntryFile(fileName, &entry) != 0) continue;
+        IndexRecord* record = putRecord(strtoull(child->d_name, NULL, 16));
+        if (!record) break;
+        record->size = entry.size;
+        record->contentHash = entry.contentHash;
+        record->lastUsed = status.st_mtime;
+        record->uses = 1;
+        indexMap->totalSize += entry.size;
+    } // next child
+    closedir(directory);
+}
+
+/* locks the index against other threads and processes, and maps it into memory
+ * - returns 0 on success, in which case unlockIndex() must be called */
+static int lockIndex(void) {
+    pthread_mutex_lock(&indexLock);
+    if (indexFd < 0) {
+        char fileName[CACHE_MAX_PATH];
+        int truncated = snprintf(fileName, sizeof(fileName), "%s/%s", cacheDirectory(), INDEX_FILE) >= (int)sizeof(fileName);
+        if (!truncated) indexFd = open(fileName, O_RDWR | O_CREAT, 0600);
+        if (indexFd < 0) {
+            fprintf(stderr, "Could not open cache index: %s\n", fileName);
+            pthread_mutex_unlock(&indexLock);
+            return -1;
+        }
+    }
+    flock(indexFd, LOCK_EX);
+    if (mapIndex(INDEX_INITIAL_CAPACITY) != 0) {
+        fprintf(stderr, "Could not map cache index\n");
+        flock(indexFd, LOCK_UN);
+        pthread_mutex_unlock(&indexLock);
+        return -1;
+    }
+    if (memcmp(indexMap->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) rebuildIndex();
+    return 0;
+}
+
+/* releases the lock taken by lockIndex() */
+static void unlockIndex(void) {
+    flock(indexFd, LOCK_UN);
+    pthread_mutex_unlock(&indexLock);
+}
+
+/* records that the given entry has just been used, and its size and content hash
+ * (or -1 and 0 if they're not known) */
+static void indexRecordUse(const char* key, long long size, unsigned long long contentHash) {
+    if (lockIndex() != 0) return;
+    IndexRecord* record = putRecord(strtoull(key, NULL, 16));
+    if (record) {
+        if (size >= 0) {
+            indexMap->totalSize += size - record->size;
+            record->size = size;
+        }
+        if (contentHash) record->contentHash = contentHash;
+        record->lastUsed = time(NULL);
+        record->uses++;
+    }
+    unlockIndex();
+}
+
+/* removes the given entry from the index */
+static void indexRemove(const char* key) {
+    if (lockIndex() != 0) return;
+    removeRecord(strtoull(key, NULL, 16));
+    unlockIndex();
+}
+
+/* returns the maximum size of the cache in bytes */
+static long long cacheQuota(void) {
+    const char* setting = getenv("WEBSENDPRAAT_CACHE_SIZE");
+    long long megabytes = setting && *setting ? atoll(setting) : DEFAULT_QUOTA_MB;
+    if (megabytes <= 0) megabytes = DEFAULT_QUOTA_MB;
+    return megabytes * 1024 * 1024;
+}
+
+/* deletes everything in the given entry's directory, and the directory itself */
+static void deleteEntryDirectory(uint64_t key) {
+    char directoryName[CACHE_MAX_PATH];
+    if (snprintf(directoryName, sizeof(directoryName), "%s/%016llx", cacheDirectory(), (unsigned long long)key) >= (int)sizeof(directoryName)) return;
+    DIR* directory = opendir(directoryName);
+    if (!directory) return;
+    struct dirent* child;
+    while ((child = readdir(directory))) {
+        if (strcmp(child->d_name, ".") == 0 || strcmp(child->d_name, "..") == 0) continue;
+        char fileName[CACHE_MAX_PATH];
+        // a name that doesn't fit can't be a file we made, so it's left alone (and so is the directory)
+        if (snprintf(fileName, sizeof(fileName), "%s/%s", directoryName, child->d_name) >= (int)sizeof(fileName)) continue;
+        remove(fileName);
+    } // next child
+    closedir(directory);
+    rmdir(directoryName);
+}
+
+/* orders index records from least to most recently used */
+static int compareLastUsed(const void* a, const void* b) {
+    int64_t aUsed = ((const IndexRecord*)a)->lastUsed;
+    int64_t bUsed = ((const IndexRecord*)b)->lastUsed;
+    return aUsed < bUsed ? -1 : aUsed > bUsed ? 1 : 0;
+}
+
+/* deletes the least recently used entries until the cache is no bigger than the given size */
+static void evict(long long quota) {
+    // take a snapshot of the index, so that it's not locked while deciding what to evict
+    if (lockIndex() != 0) return;
+    long long totalSize = indexMap->totalSize;
+    uint32_t count = indexMap->count;
+    IndexRecord* records = NULL;
+    if (totalSize > quota && count > 0) {
+        records = malloc(count * sizeof(IndexRecord));
+        if (records) memcpy(records, INDEX_RECORDS(indexMap), count * sizeof(IndexRecord));
+    }
+    unlockIndex();
+    if (!records) return;
+    
+    qsort(records, count, sizeof(IndexRecord), compareLastUsed);
+    time_t grace = time(NULL) - EVICTION_GRACE_SECONDS;
+    int evicted = 0;
+    for (uint32_t r = 0; r < count && totalSize > quota && records[r].lastUsed < grace; r++) {
+        if (lockIndex() != 0) break;
+        IndexRecord* record = findRecord(records[r].key);
+        // only if it hasn't been used since the snapshot
+        if (record && record->lastUsed == records[r].lastUsed) {
+            deleteEntryDirectory(record->key);
+            totalSize -= record->size;
+            removeRecord(record->key);
+            evicted++;
+        }
+        unlockIndex();
+    } // next record
+    free(records);
+    if (evicted) fprintf(stderr, "Evicted %d cache entries\n", evicted);
+}
+
+/* the eviction thread - keeps the cache within its quota without holding up downloads */
+static void* evictionWorker(void* unused) {
+#if defined (macintosh) || defined (__MACH__)
+    pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+#endif
+    while (1) {
+        pthread_mutex_lock(&evictionLock);
+        while (!evictionPending) pthread_cond_wait(&evictionWanted, &evictionLock);
+        evictionPending = 0;
+        pthread_mutex_unlock(&evictionLock);
+        
+        evict(cacheQuota());
+    } // next request
+    return NULL;
+}
+
+/* asks the eviction thread to check whether the cache is over its quota */
+static void evictInBackground(void) {
+    pthread_mutex_lock(&evictionLock);
+    if (!evictionThreadStarted) {
+        evictionThreadStarted = pthread_create(&evictionThread, NULL, evictionWorker, NULL) == 0;
+        if (evictionThreadStarted) pthread_detach(evictionThread);
+    }
+    evictionPending = 1;
+    pthread_cond_signal(&evictionWanted);
+    pthread_mutex_unlock(&evictionLock);
+}
+
+/* makes target a copy-on-write clone of source, if the file system can - returns 0 on success, or -1 otherwise
+ * (a hard link won't do, because Praat can save over either copy, which would change the other) */
+static int cloneFile(const char* source, const char* target) {
+    char tempName[CACHE_MAX_PATH + 8];
+    snprintf(tempName, sizeof(tempName), "%s.dedupe", target);
+    remove(tempName);
+    int cloned = -1;
+#if defined (macintosh) || defined (__MACH__)
+    cloned = clonefile(source, tempName, 0);
+#elif defined (__linux__) && defined (FICLONE)
+    int sourceFd = open(source, O_RDONLY);
+    if (sourceFd >= 0) {
+        int targetFd = open(tempName, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (targetFd >= 0) {
+            cloned = ioctl(targetFd, FICLONE, sourceFd);
+            close(targetFd);
+            if (cloned != 0) remove(tempName);
+        }
+        close(sourceFd);
+    }
+#endif
+    if (cloned != 0) return -1; // the entries keep their own copies
+    if (rename(tempName, target) != 0) {
+        remove(tempName);
+        return -1;
+    }
+    return 0;
+}
+
+/* if another entry's local copy has the same content as the given one's, makes the given one a clone of it,
+ * so that they share storage until either is written to */
+static void deduplicate(CacheEntry* entry) {
+    struct stat status;
+    if (!entry->contentHash || stat(entry->path, &status) != 0 || status.st_size == 0) return;
+    if (lockIndex() != 0) return;
+    uint64_t key = strtoull(entry->key, NULL, 16);
+    IndexRecord* records = INDEX_RECORDS(indexMap);
+    for (uint32_t r = 0; r < indexMap->count; r++) {
+        if (records[r].contentHash != entry->contentHash || records[r].size != status.st_size
+            || records[r].key == key) continue;
+        // make sure the other copy is still what was downloaded
+        char fileName[CACHE_MAX_PATH];
+        snprintf(fileName, sizeof(fileName), "%s/%016llx/%s",
+                 cacheDirectory(), (unsigned long long)records[r].key, ENTRY_FILE);
+        CacheEntry other;
+        memset(&other, 0, sizeof(CacheEntry));
+        struct stat otherStatus;
+        if (readEntryFile(fileName, &other) != 0 || other.contentHash != entry->contentHash
+            || stat(other.path, &otherStatus) != 0 || otherStatus.st_size != other.size
+            || (long long)otherStatus.st_mtime != other.mtime) continue;
+        if (cloneFile(other.path, entry->path) == 0) {
+            fprintf(stderr, "%s has the same content as %s\n", entry->url, other.url);
+            break;
+        }
+    } // next record
+    unlockIndex();
+}
@@ -0,0 +1,144 @@
+//
+//  cache.h
+//  WebSendPraat
+//
+//  Persistent cache of downloaded files, so that the same URL doesn't have to be
+//  transferred again every time it's opened.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#ifndef cache_h
+#define cache_h
+
+#include <stdio.h>
+
+/* Maximum length of a path or URL stored in the cache index */
+#define CACHE_MAX_PATH 1024
+
+/*
+ * What we know about a cached download.
+ * Each URL gets its own directory in the cache (named after the key) so that the file
+ * can keep its original name, which is what Praat uses to name the object it reads.
+ */
+typedef struct {
+    char key[17];                       /* hex hash of the normalized URL */
+    char url[CACHE_MAX_PATH];           /* normalized URL */
+    char path[CACHE_MAX_PATH];          /* full path of the local copy */
+    char etag[256];                     /* ETag validator, or "" */
+    char lastModified[128];             /* Last-Modified validator, or "" */
+    long long size;                     /* size of the local copy when it was downloaded */
+    long long mtime;                    /* modification time of the local copy when it was downloaded */
+    unsigned long long contentHash;     /* content hash of the local copy (see CacheHasher) */
+} CacheEntry;
+
+/*
+ * Returns the directory downloaded files are cached in, creating it if necessary.
+ * This is $WEBSENDPRAAT_CACHE if set, otherwise the platform's per-user cache directory.
+ */
+const char* cacheDirectory(void);
+
+/*
+ * Normalizes the given URL - lowercases the scheme and host, drops default ports
+ * and fragments (other than time ranges) - so that equivalent URLs share a cache entry.
+ * The caller is responsible for freeing the returned string.
+ */
+char* cacheNormalizeUrl(const char* url);
+
+/*
+ * Incrementally hashes the given bytes (64-bit FNV-1a).
+ * Start with CACHE_HASH_INIT.
+ */
+#define CACHE_HASH_INIT 0xcbf29ce484222325ULL
+unsigned long long cacheHash(unsigned long long hash, const void* data, size_t length);
+
+/*
+ * The state of a content hash (64-bit xxHash) being computed as a download is written.
+ * This works through the data 32 bytes at a time in four independent lanes,
+ * so it keeps up with the network far more easily than hashing byte by byte.
+ */
+typedef struct {
+    unsigned long long lanes[4];
+    unsigned long long length;          /* bytes so far */
+    unsigned char buffer[32];           /* the incomplete stripe */
+    size_t buffered;
+} CacheHasher;
+
+/*
+ * Starts computing a content hash.
+ */
+void cacheHasherStart(CacheHasher* hasher);
+
+/*
+ * Adds the given bytes to the content hash.
+ */
+void cacheHasherUpdate(CacheHasher* hasher, const void* data, size_t length);
+
+/*
+ * Returns the hash of all the bytes added so far.
+ */
+unsigned long long cacheHasherFinish(const CacheHasher* hasher);
+
+/*
+ * Adds the content of the given file to the content hash.
+ * Returns 0 on success.
+ */
+int cacheHasherAddFile(CacheHasher* hasher, const char* fileName);
+
+/*
+ * Fills in entry->key and entry->url for the given URL, and returns the
+ * directory for the entry (creating it if necessary), which the caller must free.
+ */
+char* cacheEntryDirectory(const char* url, CacheEntry* entry);
+
+/*
+ * Looks up the given URL in the cache.
+ * Returns 1 if there is an entry and the local copy hasn't changed since it was downloaded,
+ * or 0 otherwise.
+ */
+int cacheLookup(const char* url, CacheEntry* entry);
+
+/*
+ * Records the given entry in the cache index, after its content has been saved to entry->path.
+ * If another entry has exactly the same content, and the file system supports copy-on-write clones,
+ * the local copy is replaced with a clone of that entry's file, so that the content is only stored once.
+ * The size and mtime of the local copy are filled in from the file.
+ * If this takes the cache over its quota, the least recently used entries are evicted in the background.
+ * Returns 0 on success.
+ */
+int cacheStore(CacheEntry* entry);
+
+/*
+ * Removes the given URL's entry from the cache, including the local copy.
+ */
+void cacheRemove(const char* url);
+
+/*
+ * What we know about an interrupted download, so that it can be resumed later
+ * (if the server's validators show the content hasn't changed in the meantime).
+ */
+typedef struct {
+    char etag[256];
+    char lastModified[128];
+    long long size;                     /* bytes downloaded so far */
+} CachePartial;
+
+/*
+ * Reads what's known about the partial download in the given file.
+ * Returns 1 if the download can be resumed, in which case the file is truncated to
+ * partial->size bytes, or 0 otherwise.
+ */
+int cacheLoadPartial(const char* fileName, CachePartial* partial);
+
+/*
+ * Records what's known about the partial download in the given file.
+ * Returns 0 on success.
+ */
+int cacheSavePartial(const char* fileName, const CachePartial* partial);
+
+/*
+ * Deletes the given partial download file, and what's known about it.
+ */
+void cacheDiscardPartial(const char* fileName);
+
+#endif /* cache_h */
@@ -0,0 +1,306 @@
+//
+//  digest.c
+//  WebSendPraat
+//
+//  Streaming MD5 (RFC 1321) and SHA-256 (FIPS 180-4), for checking downloads against
+//  the digests servers send in Content-MD5 and Digest headers.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#include "digest.h"
+
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+static const uint32_t MD5_K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+    0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+    0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+    0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+    0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+    0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char MD5_SHIFT[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t SHA256_INIT[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static uint32_t rotateLeft(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static uint32_t rotateRight(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+/* processes one 64-byte block of MD5 */
+static void md5Block(uint32_t* state, const unsigned char* block) {
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = (uint32_t)block[i*4] | ((uint32_t)block[i*4 + 1] << 8)
+            | ((uint32_t)block[i*4 + 2] << 16) | ((uint32_t)block[i*4 + 3] << 24);
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        f += a + MD5_K[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += rotateLeft(f, MD5_SHIFT[i]);
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+/* processes one 64-byte block of SHA-256 */
+static void sha256Block(uint32_t* state, const unsigned char* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4 + 1] << 16)
+            | ((uint32_t)block[i*4 + 2] << 8) | (uint32_t)block[i*4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotateRight(w[i-15], 7) ^ rotateRight(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = rotateRight(w[i-2], 17) ^ rotateRight(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + SHA256_K[i] + w[i];
+        uint32_t s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+/* processes one 64-byte block with the digest's algorithm */
+static void digestBlock(Digest* digest, const unsigned char* block) {
+    if (digest->algorithm == DIGEST_MD5) {
+        md5Block(digest->state, block);
+    } else {
+        sha256Block(digest->state, block);
+    }
+}
+
+/*
+ * Returns the number of bytes in a digest computed with the given algorithm.
+ */
+size_t digestLength(DigestAlgorithm algorithm) {
+    switch (algorithm) {
+        case DIGEST_MD5: return 16;
+        case DIGEST_SHA256: return 32;
+        default: return 0;
+    }
+}
+
+/*
+ * Starts computing a digest with the given algorithm.
+ */
+void digestStart(Digest* digest, DigestAlgorithm algorithm) {
+    memset(digest, 0, sizeof(Digest));
+    digest->algorithm = algorithm;
+    if (algorithm == DIGEST_MD5) {
+        digest->state[0] = 0x67452301;
+        digest->state[1] = 0xefcdab89;
+        digest->state[2] = 0x98badcfe;
+        digest->state[3] = 0x10325476;
+    } else {
+        memcpy(digest->state, SHA256_INIT, sizeof(SHA256_INIT));
+    }
+}
+
+/*
+ * Adds the given bytes to the digest.
+ */
+void digestUpdate(Digest* digest, const void* data, size_t length) {
+    const unsigned char* bytes = data;
+    digest->length += length;
+    if (digest->buffered > 0) { // fill up the incomplete block first
+        size_t count = 64 - digest->buffered;
+        if (count > length) count = length;
+        memcpy(digest->buffer + digest->buffered, bytes, count);
+        digest->buffered += count;
+        bytes += count;
+        length -= count;
+        if (digest->buffered < 64) return;
+        digestBlock(digest, digest->buffer);
+        digest->buffered = 0;
+    }
+    for (; length >= 64; bytes += 64, length -= 64) digestBlock(digest, bytes);
+    memcpy(digest->buffer, bytes, length);
+    digest->buffered = length;
+}
+
+/*
+ * Finishes the digest, writing digestLength() bytes to result.
+ */
+void digestFinish(Digest* digest, unsigned char* result) {
+    uint64_t bits = digest->length * 8;
+    unsigned char padding[72];
+    memset(padding, 0, sizeof(padding));
+    padding[0] = 0x80;
+    // pad to 56 bytes into a block, then add the length in bits
+    size_t padLength = (digest->buffered < 56 ? 56 : 120) - digest->buffered;
+    for (int i = 0; i < 8; i++) {
+        // MD5 is little-endian, SHA-256 big-endian
+        int shift = digest->algorithm == DIGEST_MD5 ? i * 8 : (7 - i) * 8;
+        padding[padLength + i] = (unsigned char)(bits >> shift);
+    }
+    uint64_t length = digest->length;
+    digestUpdate(digest, padding, padLength + 8);
+    digest->length = length;
+    
+    if (digest->algorithm == DIGEST_MD5) {
+        for (int i = 0; i < 16; i++) result[i] = (unsigned char)(digest->state[i / 4] >> ((i % 4) * 8));
+    } else {
+        for (int i = 0; i < 32; i++) result[i] = (unsigned char)(digest->state[i / 4] >> ((3 - i % 4) * 8));
+    }
+}
+
+/* returns the value of the given base64 character, or -1 if it's not one */
+static int base64Value(char c) {
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+/*
+ * Decodes the given base64 text.
+ * Returns the number of bytes written to result, or -1 if the text isn't valid or needs more than max bytes.
+ */
+int digestDecodeBase64(const char* text, unsigned char* result, size_t max) {
+    size_t length = 0;
+    uint32_t bits = 0;
+    int bitCount = 0;
+    for (; *text && *text != '='; text++) {
+        int value = base64Value(*text);
+        if (value < 0) return -1;
+        bits = (bits << 6) | (uint32_t)value;
+        bitCount += 6;
+        if (bitCount >= 8) {
+            bitCount -= 8;
+            if (length >= max) return -1;
+            result[length++] = (unsigned char)(bits >> bitCount);
+        }
+    }
+    return (int)length;
+}
+
+/*
+ * Parses the value of a Digest header (e.g. "SHA-256=X48E9qOokqqrvdts8nOJRJN3OWDUoyWxBf7kbu9DBPE=,MD5=...").
+ * Returns the strongest algorithm we support that's in the header, writing its digest to expected,
+ * or DIGEST_NONE if there isn't one.
+ */
+DigestAlgorithm digestParseHeader(const char* value, unsigned char* expected) {
+    DigestAlgorithm best = DIGEST_NONE;
+    while (*value) {
+        while (*value == ' ' || *value == ',') value++;
+        size_t itemLength = strcspn(value, ",");
+        const char* equals = memchr(value, '=', itemLength);
+        if (equals) {
+            DigestAlgorithm algorithm = DIGEST_NONE;
+            size_t nameLength = equals - value;
+            if (nameLength == 7 && strncasecmp(value, "SHA-256", 7) == 0) {
+                algorithm = DIGEST_SHA256;
+            } else if (nameLength == 3 && strncasecmp(value, "MD5", 3) == 0) {
+                algorithm = DIGEST_MD5;
+            }
+            if (algorithm > best) {
+                char encoded[128];
+                size_t encodedLength = itemLength - nameLength - 1;
+                if (encodedLength < sizeof(encoded)) {
+                    memcpy(encoded, equals + 1, encodedLength);
+                    encoded[encodedLength] = '\0';
+                    while (encodedLength > 0 && isspace((unsigned char)encoded[encodedLength - 1])) {
+                        encoded[--encodedLength] = '\0';
+                    }
+                    unsigned char decoded[DIGEST_MAX_LENGTH];
+                    if (digestDecodeBase64(encoded, decoded, sizeof(decoded)) == (int)digestLength(algorithm)) {
+                        memcpy(expected, decoded, digestLength(algorithm));
+                        best = algorithm;
+                    }
+                }
+            }
+        }
+        value += itemLength;
+    } // next item
+    return best;
+}
@@ -0,0 +1,68 @@
+//
+//  digest.h
+//  WebSendPraat
+//
+//  Streaming MD5 and SHA-256, for checking downloads against the digests servers send
+//  in Content-MD5 and Digest headers.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#ifndef digest_h
+#define digest_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Length of the longest digest we compute */
+#define DIGEST_MAX_LENGTH 32
+
+typedef enum {
+    DIGEST_NONE,
+    DIGEST_MD5,
+    DIGEST_SHA256
+} DigestAlgorithm;
+
+/* The state of a digest being computed */
+typedef struct {
+    DigestAlgorithm algorithm;
+    uint32_t state[8];
+    uint64_t length;            /* bytes so far */
+    unsigned char buffer[64];   /* the incomplete block */
+    size_t buffered;
+} Digest;
+
+/*
+ * Returns the number of bytes in a digest computed with the given algorithm.
+ */
+size_t digestLength(DigestAlgorithm algorithm);
+
+/*
+ * Starts computing a digest with the given algorithm.
+ */
+void digestStart(Digest* digest, DigestAlgorithm algorithm);
+
+/*
+ * Adds the given bytes to the digest.
+ */
+void digestUpdate(Digest* digest, const void* data, size_t length);
+
+/*
+ * Finishes the digest, writing digestLength() bytes to result.
+ */
+void digestFinish(Digest* digest, unsigned char* result);
+
+/*
+ * Decodes the given base64 text.
+ * Returns the number of bytes written to result, or -1 if the text isn't valid or needs more than max bytes.
+ */
+int digestDecodeBase64(const char* text, unsigned char* result, size_t max);
+
+/*
+ * Parses the value of a Digest header (e.g. "SHA-256=X48E9qOokqqrvdts8nOJRJN3OWDUoyWxBf7kbu9DBPE=,MD5=...").
+ * Returns the strongest algorithm we support that's in the header, writing its digest to expected,
+ * or DIGEST_NONE if there isn't one.
+ */
+DigestAlgorithm digestParseHeader(const char* value, unsigned char* expected);
+
+#endif /* digest_h */
@@ -0,0 +1,252 @@
+//
+//  dispatch.c
+//  WebSendPraat
+//
+//  Processes native messaging host messages on a pool of worker threads, so that a long
+//  download for one clientRef doesn't hold up messages for the others, and writes all the
+//  responses from one writer thread.
+//
+//  Each clientRef has its own queue of messages, and only one of them is processed at a time,
+//  so a clientRef's replies (and the progress events before them) come back in the order it
+//  asked. Workers take turns between clientRefs that have messages waiting.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#include "dispatch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "json.h"
+
+/* a message waiting to be processed */
+typedef struct Message {
+    char* text;                         /* the message as it arrived, if it couldn't be parsed */
+    cJSON* json;                        /* the parsed message, or NULL if it couldn't be parsed */
+    struct Message* next;
+} Message;
+
+/* the messages for one clientRef */
+typedef struct Client {
+    char* clientRef;                    /* "" for messages without one */
+    Message* messages;                  /* waiting to be processed, oldest first */
+    int busy;                           /* whether one of its messages is being processed */
+    struct Client* next;
+} Client;
+
+/* clients with messages waiting or being processed - the one at the front is served first */
+static Client* clients = NULL;
+static pthread_mutex_t dispatchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clientReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t messageProcessed = PTHREAD_COND_INITIALIZER;
+
+/* a response waiting to be written */
+typedef struct Response {
+    char* json;
+    size_t capacity;                    /* the size of json's buffer */
+    struct Response* next;
+} Response;
+
+static Response* responses = NULL;
+static Response* spareResponses = NULL; /* written responses, kept so their buffers can be reused */
+static int spareResponseCount = 0;
+static Response** lastResponse = &responses;
+static int writing = 0;                 /* whether a response is being written */
+static void (*writer)(char* json) = NULL;
+static pthread_mutex_t writerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t responseQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t responsesWritten = PTHREAD_COND_INITIALIZER;
+
+/* returns a response to fill in, reusing a written one if there is one - must hold writerLock */
+static Response* spareResponse(void) {
+    Response* response = spareResponses;
+    if (response) {
+        spareResponses = response->next;
+        spareResponseCount--;
+    } else {
+        response = calloc(1, sizeof(Response));
+    }
+    response->next = NULL;
+    return response;
+}
+
+/* queues the given response, and wakes the writer - must hold writerLock */
+static void queueResponse(Response* response) {
+    *lastResponse = response;
+    lastResponse = &response->next;
+    pthread_cond_signal(&responseQueued);
+}
+
+/* queues the given message's reply, which is freed once it's been written */
+static void queueReply(char* json) {
+    if (!json) return;
+    pthread_mutex_lock(&writerLock);
+    Response* response = spareResponse();
+    free(response->json);
+    response->json = json;
+    response->capacity = strlen(json) + 1;
+    queueResponse(response);
+    pthread_mutex_unlock(&writerLock);
+}
+
+/* returns the first client whose next message can be processed, moving it to the back of the line
+ * so the others get a turn before it does again, or returns NULL if there isn't one - must hold dispatchLock */
+static Client* nextClient(void) {
+    Client** link = &clients;
+    while (*link && ((*link)->busy || !(*link)->messages)) link = &(*link)->next;
+    Client* client = *link;
+    if (!client) return NULL;
+    *link = client->next;
+    client->next = NULL;
+    Client** last = link;
+    while (*last) last = &(*last)->next;
+    *last = client;
+    return client;
+}
+
+/* a worker thread - processes messages one at a time */
+static void* dispatchWorker(void* unused) {
+    pthread_mutex_lock(&dispatchLock);
+    while (1) {
+        Client* client;
+        while (!(client = nextClient())) pthread_cond_wait(&clientReady, &dispatchLock);
+        Message* message = client->messages;
+        client->messages = message->next;
+        client->busy = 1;
+        pthread_mutex_unlock(&dispatchLock);
+
+        char* reply = message->json ? jsonMessageParsed(message->json, dispatchResponse)
+            : jsonMessage(message->text, dispatchResponse);
+        queueReply(reply);
+        free(message->text);
+        free(message);
+
+        pthread_mutex_lock(&dispatchLock);
+        client->busy = 0;
+        if (client->messages) { // its next message can be processed now
+            pthread_cond_signal(&clientReady);
+        } else { // nothing else for it
+            Client** link = &clients;
+            while (*link != client) link = &(*link)->next;
+            *link = client->next;
+            free(client->clientRef);
+            free(client);
+        }
+        pthread_cond_broadcast(&messageProcessed);
+    } // next message
+    return NULL;
+}
+
+/* the writer thread - writes responses in the order they were queued */
+static void* dispatchWriter(void* unused) {
+    pthread_mutex_lock(&writerLock);
+    while (1) {
+        while (!responses) pthread_cond_wait(&responseQueued, &writerLock);
+        Response* response = responses;
+        responses = response->next;
+        if (!responses) lastResponse = &responses;
+        writing = 1;
+        pthread_mutex_unlock(&writerLock);
+
+        writer(response->json);
+
+        pthread_mutex_lock(&writerLock);
+        if (spareResponseCount < DISPATCH_SPARE_RESPONSES) {
+            if (response->capacity > DISPATCH_SPARE_RESPONSE_SIZE) { // e.g. a big reply, which isn't worth keeping
+                free(response->json);
+                response->json = NULL;
+                response->capacity = 0;
+            }
+            response->next = spareResponses;
+            spareResponses = response;
+            spareResponseCount++;
+        } else {
+            free(response->json);
+            free(response);
+        }
+        writing = 0;
+        if (!responses) pthread_cond_broadcast(&responsesWritten);
+    } // next response
+    return NULL;
+}
+
+/*
+ * Starts the worker threads and the writer thread, which writes each response with the given function.
+ */
+void dispatchStart(void (*writeResponse)(char* json)) {
+    writer = writeResponse;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, dispatchWriter, NULL) == 0) pthread_detach(thread);
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    // threads other than the main one get a much smaller stack by default on some platforms
+    pthread_attr_setstacksize(&attributes, DISPATCH_STACK_SIZE);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    for (int w = 0; w < DISPATCH_WORKERS; w++) {
+        if (pthread_create(&thread, &attributes, dispatchWorker, NULL) != 0) {
+            fprintf(stderr, "Could not start message worker %d\n", w);
+        }
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+/*
+ * Queues the given message to be processed by a worker thread.
+ */
+void dispatchMessage(char* json) {
+    Message* message = calloc(1, sizeof(Message));
+    // it's parsed here, to find out who it's from
+    message->json = cJSON_Parse(json);
+    if (message->json) {
+        free(json);
+    } else { // it's parsed again by jsonMessage(), which says what's wrong with it
+        message->text = json;
+    }
+    const cJSON* clientRef = cJSON_GetObjectItemCaseSensitive(message->json, "clientRef");
+    const char* ref = cJSON_IsString(clientRef) && clientRef->valuestring ? clientRef->valuestring : "";
+
+    pthread_mutex_lock(&dispatchLock);
+    Client** link = &clients;
+    while (*link && strcmp((*link)->clientRef, ref) != 0) link = &(*link)->next;
+    if (!*link) { // new clients join the back of the line
+        *link = calloc(1, sizeof(Client));
+        (*link)->clientRef = strdup(ref);
+    }
+    Message** last = &(*link)->messages;
+    while (*last) last = &(*last)->next;
+    *last = message;
+    pthread_cond_signal(&clientReady);
+    pthread_mutex_unlock(&dispatchLock);
+}
+
+/*
+ * Queues the given response to be written by the writer thread.
+ */
+void dispatchResponse(char* json) {
+    if (!json) return;
+    size_t length = strlen(json) + 1;
+    pthread_mutex_lock(&writerLock);
+    Response* response = spareResponse();
+    if (response->capacity < length) {
+        free(response->json);
+        response->json = malloc(length);
+        response->capacity = length;
+    }
+    memcpy(response->json, json, length);
+    queueResponse(response);
+    pthread_mutex_unlock(&writerLock);
+}
+
+/*
+ * Waits until all the queued messages have been processed, and all the queued responses written.
+ */
+void dispatchFinish(void) {
+    pthread_mutex_lock(&dispatchLock);
+    while (clients) pthread_cond_wait(&messageProcessed, &dispatchLock);
+    pthread_mutex_unlock(&dispatchLock);
+    pthread_mutex_lock(&writerLock);
+    while (responses || writing) pthread_cond_wait(&responsesWritten, &writerLock);
+    pthread_mutex_unlock(&writerLock);
+}
@@ -0,0 +1,50 @@
+//
+//  dispatch.h
+//  WebSendPraat
+//
+//  Processes native messaging host messages on a pool of worker threads, so that a long
+//  download for one clientRef doesn't hold up messages for the others, and writes all the
+//  responses from one writer thread.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#ifndef dispatch_h
+#define dispatch_h
+
+/* The most messages processed at the same time */
+#define DISPATCH_WORKERS 4
+
+/* How many written responses' buffers are kept for reuse, and how big they can be, so that
+ * progress events don't need memory allocating for them */
+#define DISPATCH_SPARE_RESPONSES 16
+#define DISPATCH_SPARE_RESPONSE_SIZE 4096
+
+/* The stack size of worker threads - the same as the main thread's usually is, because messages with many lines use a lot */
+#define DISPATCH_STACK_SIZE (8 * 1024 * 1024)
+
+/*
+ * Starts the worker threads and the writer thread, which writes each response with the given function.
+ */
+void dispatchStart(void (*writeResponse)(char* json));
+
+/*
+ * Queues the given message (which is freed once it's been processed) to be processed by a worker thread.
+ * Messages for the same clientRef are processed one at a time, in the order they arrive, so their
+ * responses are too. Messages for different clientRefs take turns.
+ */
+void dispatchMessage(char* json);
+
+/*
+ * Queues the given response (which isn't kept - it's copied into a buffer reused from
+ * responses that have already been written) to be written by the writer thread.
+ * Responses are written in the order they're queued.
+ */
+void dispatchResponse(char* json);
+
+/*
+ * Waits until all the queued messages have been processed, and all the queued responses written.
+ */
+void dispatchFinish(void);
+
+#endif /* dispatch_h */
@@ -0,0 +1,374 @@
+//
+//  journal.c
+//  WebSendPraat
+//
+//  Keeps a journal of queued uploads in the cache directory, so that uploads that haven't
+//  been done yet survive the host being stopped and started again.
+//
+//  Each host process appends to its own journal, <cache>/uploads/<pid>.journal, one JSON record
+//  per line - {"add":id,...} when an upload is queued, {"attempt":id} when it fails, and
+//  {"done":id} when it's finished with - and keeps a copy of each file in <cache>/uploads/<pid>.<id>.
+//  Journals left by processes that have exited are taken over by the next process to start.
+//  Authorization header values are never journaled; they're only kept in memory by the process
+//  that queued the upload.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "cache.h"
+#include "cjson/cJSON.h"
+
+static int journalFd = -1;
+static long nextId = 1;
+static int pendingCount = 0;            /* uploads added that haven't been finished with */
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+
+static char directory[CACHE_MAX_PATH];
+static pthread_once_t directoryOnce = PTHREAD_ONCE_INIT;
+
+/* works out the journal directory, and creates it if necessary */
+static void initJournalDirectory(void) {
+    if (snprintf(directory, sizeof(directory), "%s/uploads", cacheDirectory()) >= (int)sizeof(directory)) {
+        fprintf(stderr, "Upload journal directory name too long: %s/uploads\n", cacheDirectory());
+        directory[0] = '\0';
+        return;
+    }
+    mkdir(directory, 0700);
+}
+
+/* the directory journals and their files are kept in, or NULL if there isn't one */
+static const char* journalDirectory(void) {
+    pthread_once(&directoryOnce, initJournalDirectory);
+    return directory[0] ? directory : NULL;
+}
+
+/* opens this process's journal, if it isn't already - must hold journalLock */
+static int openJournal(void) {
+    if (journalFd >= 0) return 0;
+    const char* directoryName = journalDirectory();
+    if (!directoryName) return -1;
+    char fileName[CACHE_MAX_PATH];
+    if (snprintf(fileName, sizeof(fileName), "%s/%ld.journal", directoryName, (long)getpid()) >= (int)sizeof(fileName)) {
+        fprintf(stderr, "Upload journal name too long: %s/%ld.journal\n", directoryName, (long)getpid());
+        return -1;
+    }
+    journalFd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (journalFd < 0) {
+        fprintf(stderr, "Could not open upload journal %s: %s\n", fileName, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* appends the given record to the journal, and makes sure it's on disk, then frees it - must hold journalLock */
+static int appendRecord(cJSON* record) {
+    char* json = cJSON_PrintUnformatted(record);
+    cJSON_Delete(record);
+    if (!json || openJournal() != 0) {
+        free(json);
+        return -1;
+    }
+    size_t length = strlen(json);
+    json[length++] = '\n'; // replaces the terminator
+    // the whole record is written at once, so a crash can only leave the last line unfinished
+    ssize_t written = write(journalFd, json, length);
+    free(json);
+    if (written != (ssize_t)length || fsync(journalFd) != 0) {
+        fprintf(stderr, "Could not write to upload journal: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* adds a string member to the given record, if the value's not NULL */
+static void addString(cJSON* record, const char* name, const char* value) {
+    if (value) cJSON_AddStringToObject(record, name, value);
+}
+
+/* returns a copy of the given string member of the given record, or NULL if it's not there */
+static char* copyString(const cJSON* record, const char* name) {
+    const cJSON* member = cJSON_GetObjectItemCaseSensitive(record, name);
+    return cJSON_IsString(member) && member->valuestring ? strdup(member->valuestring) : NULL;
+}
+
+/* records that the given upload has been queued - must hold journalLock */
+static int appendAdd(JournalUpload* upload) {
+    cJSON* record = cJSON_CreateObject();
+    cJSON_AddNumberToObject(record, "add", upload->id);
+    addString(record, "uploadUrl", upload->uploadUrl);
+    addString(record, "fileParameter", upload->fileParameter);
+    addString(record, "fileName", upload->fileName);
+    addString(record, "fileUrl", upload->fileUrl);
+    addString(record, "otherParameters", upload->otherParameters);
+    // the authorization itself stays in memory, so credentials aren't left lying around on disk
+    if (upload->authorization || upload->authorized) cJSON_AddTrueToObject(record, "authorized");
+    addString(record, "clientRef", upload->clientRef);
+    cJSON_AddBoolToObject(record, "gzip", upload->gzip);
+    cJSON_AddNumberToObject(record, "attempts", upload->attempts);
+    return appendRecord(record);
+}
+
+/* makes target a copy of source, and makes sure it's on disk */
+static int copyFile(const char* source, const char* target) {
+    int sourceFd = open(source, O_RDONLY);
+    if (sourceFd < 0) return -1;
+    int targetFd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (targetFd < 0) {
+        close(sourceFd);
+        return -1;
+    }
+    char buffer[65536];
+    ssize_t bytesRead;
+    int result = 0;
+    while ((bytesRead = read(sourceFd, buffer, sizeof(buffer))) > 0) {
+        if (write(targetFd, buffer, bytesRead) != bytesRead) {
+            result = -1;
+            break;
+        }
+    }
+    if (bytesRead < 0 || fsync(targetFd) != 0) result = -1;
+    close(sourceFd);
+    close(targetFd);
+    if (result != 0) unlink(target);
+    return result;
+}
+
+/* deletes the given upload's copy of its file, and the directory it's in */
+static void deleteCopy(const char* fileName) {
+    if (!fileName) return;
+    unlink(fileName);
+    char* directory = strdup(fileName);
+    char* lastSlash = strrchr(directory, '/');
+    if (lastSlash) {
+        *lastSlash = '\0';
+        rmdir(directory);
+    }
+    free(directory);
+}
+
+/* reads the uploads that the given journal has that haven't been finished with, and appends them to the given list */
+static void readJournal(const char* fileName, JournalUpload*** last) {
+    FILE* file = fopen(fileName, "r");
+    if (!file) return;
+    JournalUpload* uploads = NULL;
+    char* line = NULL;
+    size_t lineCapacity = 0;
+    while (getline(&line, &lineCapacity, file) > 0) {
+        cJSON* record = cJSON_Parse(line);
+        if (!record) continue; // the last line may have been cut short
+        const cJSON* add = cJSON_GetObjectItemCaseSensitive(record, "add");
+        const cJSON* attempt = cJSON_GetObjectItemCaseSensitive(record, "attempt");
+        const cJSON* done = cJSON_GetObjectItemCaseSensitive(record, "done");
+        if (cJSON_IsNumber(add)) {
+            JournalUpload* upload = calloc(1, sizeof(JournalUpload));
+            upload->id = (long)add->valuedouble;
+            upload->uploadUrl = copyString(record, "uploadUrl");
+            upload->fileParameter = copyString(record, "fileParameter");
+            upload->fileName = copyString(record, "fileName");
+            upload->fileUrl = copyString(record, "fileUrl");
+            upload->otherParameters = copyString(record, "otherParameters");
+            upload->authorized = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(record, "authorized"));
+            upload->clientRef = copyString(record, "clientRef");
+            upload->gzip = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(record, "gzip"));
+            const cJSON* attempts = cJSON_GetObjectItemCaseSensitive(record, "attempts");
+            if (cJSON_IsNumber(attempts)) upload->attempts = attempts->valueint;
+            upload->next = uploads;
+            uploads = upload;
+        } else if (cJSON_IsNumber(attempt) || cJSON_IsNumber(done)) {
+            long id = (long)(cJSON_IsNumber(attempt) ? attempt : done)->valuedouble;
+            JournalUpload** link = &uploads;
+            while (*link && (*link)->id != id) link = &(*link)->next;
+            if (*link && cJSON_IsNumber(attempt)) {
+                (*link)->attempts++;
+            } else if (*link) {
+                JournalUpload* finished = *link;
+                *link = finished->next;
+                journalFreeUpload(finished);
+            }
+        }
+        cJSON_Delete(record);
+    } // next line
+    free(line);
+    fclose(file);
+
+    // the list was built backwards, so reverse it onto the end of the given list
+    JournalUpload* reversed = NULL;
+    while (uploads) {
+        JournalUpload* upload = uploads;
+        uploads = upload->next;
+        upload->next = reversed;
+        reversed = upload;
+    }
+    for (JournalUpload* upload = reversed; upload; ) {
+        JournalUpload* next = upload->next;
+        struct stat status;
+        if (!upload->uploadUrl || !upload->fileParameter || !upload->fileName
+            || stat(upload->fileName, &status) != 0) {
+            // a crash between deleting the copy and recording that it was done
+            journalFreeUpload(upload);
+        } else {
+            upload->next = NULL;
+            **last = upload;
+            *last = &upload->next;
+        }
+        upload = next;
+    }
+}
+
+/*
+ * Returns the uploads that were queued by earlier host processes but not finished with,
+ * in the order they were queued, moving them into this process's journal.
+ */
+JournalUpload* journalLoad(void) {
+    JournalUpload* uploads = NULL;
+    JournalUpload** last = &uploads;
+    const char* directoryName = journalDirectory();
+    pthread_mutex_lock(&journalLock);
+    DIR* directory = directoryName ? opendir(directoryName) : NULL;
+    if (directory) {
+        // find the journals to take over first, so the ones being renamed aren't come across again
+        char** journals = NULL;
+        int journalCount = 0;
+        struct dirent* child;
+        while ((child = readdir(directory))) {
+            // journals are named <pid>.journal, or <pid>.adopted.<n> while they're being taken over
+            char* dot = NULL;
+            long pid = strtol(child->d_name, &dot, 10);
+            if (pid <= 0 || (strcmp(dot, ".journal") != 0 && strncmp(dot, ".adopted.", 9) != 0)) continue;
+            // one left by an earlier process with the same pid as this one is fair game too
+            if (pid != getpid() && (kill((pid_t)pid, 0) == 0 || errno != ESRCH)) continue; // still running
+            journals = realloc(journals, (journalCount + 1) * sizeof(char*));
+            journals[journalCount++] = strdup(child->d_name);
+        } // next file
+        closedir(directory);
+
+        int adopted = 0;
+        for (int j = 0; j < journalCount; j++) {
+            char fileName[CACHE_MAX_PATH];
+            char adoptedName[CACHE_MAX_PATH];
+            int truncated = snprintf(fileName, sizeof(fileName), "%s/%s", directoryName, journals[j]) >= (int)sizeof(fileName)
+                || snprintf(adoptedName, sizeof(adoptedName), "%s/%ld.adopted.%d", directoryName, (long)getpid(), adopted + 1) >= (int)sizeof(adoptedName);
+            if (truncated) fprintf(stderr, "Upload journal name too long: %s/%s\n", directoryName, journals[j]);
+            free(journals[j]);
+            // renaming it makes sure that no other process starting at the same time takes it over too
+            if (truncated || rename(fileName, adoptedName) != 0) continue;
+            adopted++;
+            readJournal(adoptedName, &last);
+        } // next journal
+        free(journals);
+
+        // record them in this process's journal before forgetting the old ones
+        for (JournalUpload* upload = uploads; upload; upload = upload->next) {
+            upload->id = nextId++;
+            appendAdd(upload);
+            pendingCount++;
+        }
+        for (int a = 1; a <= adopted; a++) {
+            char adoptedName[CACHE_MAX_PATH];
+            // it was renamed to this above, so it fits
+            if (snprintf(adoptedName, sizeof(adoptedName), "%s/%ld.adopted.%d", directoryName, (long)getpid(), a) < (int)sizeof(adoptedName)) {
+                unlink(adoptedName);
+            }
+        }
+    }
+    openJournal();
+    pthread_mutex_unlock(&journalLock);
+    return uploads;
+}
+
+/*
+ * Records the given upload in the journal, copying the given file so that later changes
+ * to it don't affect what's uploaded.
+ */
+int journalAdd(JournalUpload* upload, const char* fileName) {
+    pthread_mutex_lock(&journalLock);
+    upload->id = nextId++;
+    const char* lastSlash = strrchr(fileName, '/');
+    const char* name = lastSlash ? lastSlash + 1 : fileName;
+    const char* directoryName = journalDirectory();
+    char copyName[CACHE_MAX_PATH];
+    // the copy keeps the file's name, because that's what it's uploaded as
+    int copyDirectoryLength = directoryName ? snprintf(copyName, sizeof(copyName), "%s/%ld.%ld", directoryName, (long)getpid(), upload->id) : 0;
+    int result = -1;
+    if (!directoryName) {
+        fprintf(stderr, "Could not queue %s: there's no upload journal directory\n", fileName);
+    } else if (copyDirectoryLength + 1 + strlen(name) >= sizeof(copyName)) {
+        fprintf(stderr, "Could not queue %s: the journal's copy's name would be too long\n", fileName);
+    } else if (mkdir(copyName, 0700) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create %s: %s\n", copyName, strerror(errno));
+    } else {
+        snprintf(copyName + copyDirectoryLength, sizeof(copyName) - copyDirectoryLength, "/%s", name);
+        if (copyFile(fileName, copyName) != 0) {
+            fprintf(stderr, "Could not copy %s to %s: %s\n", fileName, copyName, strerror(errno));
+            deleteCopy(copyName);
+        } else {
+            free(upload->fileName);
+            upload->fileName = strdup(copyName);
+            result = appendAdd(upload);
+            if (result == 0) {
+                pendingCount++;
+            } else {
+                deleteCopy(copyName);
+            }
+        }
+    }
+    pthread_mutex_unlock(&journalLock);
+    return result;
+}
+
+/*
+ * Records that the given upload has failed again.
+ */
+void journalRecordAttempt(JournalUpload* upload) {
+    pthread_mutex_lock(&journalLock);
+    cJSON* record = cJSON_CreateObject();
+    cJSON_AddNumberToObject(record, "attempt", upload->id);
+    appendRecord(record);
+    pthread_mutex_unlock(&journalLock);
+}
+
+/*
+ * Records that the given upload has been finished with, and deletes the journal's copy of its file.
+ */
+void journalFinish(JournalUpload* upload) {
+    pthread_mutex_lock(&journalLock);
+    // the copy goes first, so if there's a crash before the record is written, the upload isn't done again
+    deleteCopy(upload->fileName);
+    cJSON* record = cJSON_CreateObject();
+    cJSON_AddNumberToObject(record, "done", upload->id);
+    appendRecord(record);
+    if (--pendingCount == 0 && journalFd >= 0) {
+        // nothing's waiting, so there's nothing worth keeping
+        if (ftruncate(journalFd, 0) != 0) {
+            fprintf(stderr, "Could not empty upload journal: %s\n", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&journalLock);
+}
+
+/*
+ * Frees the given upload.
+ */
+void journalFreeUpload(JournalUpload* upload) {
+    if (!upload) return;
+    free(upload->uploadUrl);
+    free(upload->fileParameter);
+    free(upload->fileName);
+    free(upload->fileUrl);
+    free(upload->otherParameters);
+    free(upload->authorization);
+    free(upload->clientRef);
+    free(upload);
+}
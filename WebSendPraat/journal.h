@@ -0,0 +1,62 @@
+//
+//  journal.h
+//  WebSendPraat
+//
+//  Keeps a journal of queued uploads in the cache directory, so that uploads that haven't
+//  been done yet survive the host being stopped and started again.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#ifndef journal_h
+#define journal_h
+
+/* An upload recorded in the journal */
+typedef struct JournalUpload {
+    long id;                            /* identifies it in this process's journal */
+    char* uploadUrl;
+    char* fileParameter;
+    char* fileName;                     /* the journal's own copy of the file */
+    char* fileUrl;                      /* original URL of the downloaded file */
+    char* otherParameters;              /* extra HTTP request parameters, as JSON, or NULL */
+    char* authorization;                /* Authorization header value, or NULL - only kept in memory, never journaled */
+    int authorized;                     /* whether it was queued with an authorization (which uploads from earlier processes no longer have) */
+    char* clientRef;                    /* NULL if there isn't one */
+    int gzip;
+    int attempts;                       /* how many times it's failed */
+    long long retryAt;                  /* when it can next be tried, in seconds since the epoch (not journaled) */
+    struct JournalUpload* next;
+} JournalUpload;
+
+/*
+ * Returns the uploads that were queued by earlier host processes but not finished with,
+ * in the order they were queued, moving them into this process's journal.
+ * Their authorization isn't journaled, so those that had one are returned with authorized set, but no authorization.
+ * Should only be called once, before anything else is added to the journal.
+ */
+JournalUpload* journalLoad(void);
+
+/*
+ * Records the given upload in the journal, copying the given file so that later changes
+ * to it don't affect what's uploaded. Sets the upload's id and fileName.
+ * Returns 0 on success, or -1 if it couldn't be recorded (in which case an error has been printed).
+ */
+int journalAdd(JournalUpload* upload, const char* fileName);
+
+/*
+ * Records that the given upload has failed again.
+ */
+void journalRecordAttempt(JournalUpload* upload);
+
+/*
+ * Records that the given upload has been finished with (whether it succeeded or was given up on),
+ * and deletes the journal's copy of its file.
+ */
+void journalFinish(JournalUpload* upload);
+
+/*
+ * Frees the given upload.
+ */
+void journalFreeUpload(JournalUpload* upload);
+
+#endif /* journal_h */
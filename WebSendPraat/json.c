@@ -9,33 +9,442 @@
 #include "json.h"
 
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 #include "web.h"
+#include "journal.h"
 #include "sendpraat.h"
 
+static void (*eventHandler)(char* json) = NULL;
+
+/* set by jsonStop(), when the background threads should finish */
+static volatile int stopping = 0;
+
+static void resumeUploads(JournalUpload* uploads);
+
+/*
+ * Sets the function that sends JSON messages back to the caller asynchronously.
+ */
+void jsonSetEventHandler(void (*handler)(char* json)) {
+    static int journalLoaded = 0;
+    eventHandler = handler;
+    if (handler && !journalLoaded) {
+        // now there's someone to tell, carry on with uploads queued before the host was last stopped
+        journalLoaded = 1;
+        JournalUpload* uploads = journalLoad();
+        if (uploads) resumeUploads(uploads);
+    }
+}
+
+/* A prefetch request waiting to be processed */
+typedef struct PrefetchJob {
+    char** urls;
+    int urlCount;
+    char* authorization;
+    char* clientRef;
+    long timeout;               /* milliseconds the downloads may take, or 0 for no limit */
+    struct PrefetchJob* next;
+} PrefetchJob;
+
+static PrefetchJob* prefetchQueue = NULL;
+static pthread_mutex_t prefetchLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetchQueued = PTHREAD_COND_INITIALIZER;
+static pthread_t prefetchThread;
+static int prefetchThreadStarted = 0;
+
+/* sends the given JSON message as an event, and frees it */
+static void sendEvent(cJSON* event) {
+    char* json = cJSON_Print(event);
+    if (eventHandler) eventHandler(json);
+    free(json);
+    cJSON_Delete(event);
+}
+
+/* downloads the given job's URLs, passing progress events to the given function (if any), and returns the outcome */
+static cJSON* runPrefetch(PrefetchJob* job, void (*sendProgress)(char* json)) {
+    char* downloadError = NULL;
+    ProgressTransfer* progress = progressStart(job->clientRef, "download", "Prefetching...", "Prefetched.", sendProgress);
+    int downloaded = downloadAllHttpToLocal(job->urls, job->urlCount, TRANSFER_PREFETCH, job->timeout, job->authorization, progress, &downloadError);
+    progressFinish(progress);
+    cJSON* outcome = cJSON_CreateObject();
+    cJSON_AddStringToObject(outcome, "message", "prefetched");
+    if (downloadError) {
+        cJSON_AddStringToObject(outcome, "error", downloadError);
+        cJSON_AddNumberToObject(outcome, "code", downloaded == DOWNLOAD_TIMED_OUT ? 601 : 600);
+        free(downloadError);
+    } else {
+        cJSON_AddNumberToObject(outcome, "code", 0);
+    }
+    if (job->clientRef) cJSON_AddStringToObject(outcome, "clientRef", job->clientRef);
+    return outcome;
+}
+
+/* frees the given job */
+static void freePrefetchJob(PrefetchJob* job) {
+    for (int u = 0; u < job->urlCount; u++) free(job->urls[u]);
+    free(job->urls);
+    free(job->authorization);
+    free(job->clientRef);
+    free(job);
+}
+
+/* whether the given jobs are from the same caller */
+static int sameClient(const char* clientRef, const char* otherClientRef) {
+    return strcmp(clientRef ? clientRef : "", otherClientRef ? otherClientRef : "") == 0;
+}
+
+/* takes the next job off the prefetch queue, taking turns between callers so that one caller
+ * prefetching a lot doesn't hold up the others - must hold prefetchLock */
+static PrefetchJob* nextPrefetchJob(void) {
+    static char* lastClientRef = NULL;
+    PrefetchJob** next = &prefetchQueue;
+    for (PrefetchJob** candidate = &prefetchQueue; *candidate; candidate = &(*candidate)->next) {
+        if (!sameClient((*candidate)->clientRef, lastClientRef)) {
+            next = candidate;
+            break;
+        }
+    }
+    PrefetchJob* job = *next;
+    *next = job->next;
+    free(lastClientRef);
+    lastClientRef = strdup(job->clientRef ? job->clientRef : "");
+    return job;
+}
+
+/* the prefetch thread - downloads queued URLs in the background, one request at a time */
+static void* prefetchWorker(void* unused) {
+#if mac
+    // background quality of service also throttles disk and network I/O
+    pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+#endif
+    while (1) {
+        pthread_mutex_lock(&prefetchLock);
+        while (!prefetchQueue && !stopping) pthread_cond_wait(&prefetchQueued, &prefetchLock);
+        if (stopping) {
+            pthread_mutex_unlock(&prefetchLock);
+            break;
+        }
+        PrefetchJob* job = nextPrefetchJob();
+        pthread_mutex_unlock(&prefetchLock);
+        
+        cJSON* outcome = runPrefetch(job, eventHandler);
+        if (stopping) cJSON_Delete(outcome); // it was interrupted, so there's nothing to say
+        else sendEvent(outcome);
+        freePrefetchJob(job);
+    } // next job
+    return NULL;
+}
+
+/* adds the given job to the end of the prefetch queue */
+static void queuePrefetch(PrefetchJob* job) {
+    pthread_mutex_lock(&prefetchLock);
+    if (!prefetchThreadStarted) {
+        prefetchThreadStarted = pthread_create(&prefetchThread, NULL, prefetchWorker, NULL) == 0;
+    }
+    PrefetchJob** last = &prefetchQueue;
+    while (*last) last = &(*last)->next;
+    *last = job;
+    pthread_cond_signal(&prefetchQueued);
+    pthread_mutex_unlock(&prefetchLock);
+}
+
+/* How many times a queued upload is tried before it's given up on */
+#define UPLOAD_MAX_ATTEMPTS 8
+
+/* How long to wait before trying a failed upload again, in seconds - doubled after each failure, up to UPLOAD_RETRY_MAX_DELAY */
+#define UPLOAD_RETRY_DELAY 2
+#define UPLOAD_RETRY_MAX_DELAY 300
+
+static JournalUpload* uploadQueue = NULL;
+static pthread_mutex_t uploadLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t uploadQueued = PTHREAD_COND_INITIALIZER;
+static pthread_t uploadThread;
+static int uploadThreadStarted = 0;
+
+/* whether an upload that failed with the given HTTP response code might work if it's tried again -
+ * i.e. the server couldn't be reached, had a problem of its own, or asked for it to be sent later */
+static int worthRetrying(long status) {
+    return status == 0 || status >= 500 || status == 408 || status == 429;
+}
+
+/* finishes with the given queued upload, and returns the "uploaded" event with the given outcome */
+static cJSON* finishQueuedUpload(JournalUpload* upload, cJSON* outcome) {
+    journalFinish(upload);
+    cJSON_AddStringToObject(outcome, "message", "uploaded");
+    if (upload->fileUrl) cJSON_AddStringToObject(outcome, "fileUrl", upload->fileUrl);
+    if (upload->clientRef) cJSON_AddStringToObject(outcome, "clientRef", upload->clientRef);
+    return outcome;
+}
+
+/* tries the given queued upload, and returns the event saying how it went, or NULL if it should be tried again later */
+static cJSON* runQueuedUpload(JournalUpload* upload) {
+    cJSON* otherParameters = upload->otherParameters ? cJSON_Parse(upload->otherParameters) : NULL;
+    UploadRequest request = { upload->uploadUrl, upload->fileParameter, upload->fileName, otherParameters, NULL, NULL, 0 };
+    ProgressTransfer* progress = progressStart(upload->clientRef, "upload", "Uploading...", "Uploaded.", eventHandler);
+    uploadFiles(&request, 1, upload->gzip, upload->authorization, progress);
+    progressFinish(progress);
+    cJSON_Delete(otherParameters);
+    cJSON* outcome = request.response;
+    char* error = request.error;
+    if (outcome) { // return the server's response
+        cJSON_AddNumberToObject(outcome, "code", 0);
+    } else if (stopping) { // it was interrupted, so it's left in the journal for next time
+        free(error);
+        return NULL;
+    } else if (worthRetrying(request.status) && ++upload->attempts < UPLOAD_MAX_ATTEMPTS) {
+        int delay = UPLOAD_RETRY_DELAY << (upload->attempts - 1);
+        if (delay > UPLOAD_RETRY_MAX_DELAY) delay = UPLOAD_RETRY_MAX_DELAY;
+        fprintf(stderr, "Upload of %s failed (attempt %d), trying again in %ds\n", upload->fileName, upload->attempts, delay);
+        upload->retryAt = (long long)time(NULL) + delay;
+        journalRecordAttempt(upload);
+        free(error);
+        return NULL;
+    } else { // give up
+        outcome = cJSON_CreateObject();
+        cJSON_AddNumberToObject(outcome, "code", 700);
+        if (error) cJSON_AddStringToObject(outcome, "error", error);
+    }
+    free(error);
+    return finishQueuedUpload(upload, outcome);
+}
+
+/* the upload thread - uploads queued files in the background, one at a time, trying failed ones again later */
+static void* uploadWorker(void* unused) {
+    pthread_mutex_lock(&uploadLock);
+    while (!stopping) {
+        if (!uploadQueue) {
+            pthread_cond_wait(&uploadQueued, &uploadLock);
+            continue;
+        }
+        // the first one that's due, or else the one that will be due soonest
+        JournalUpload** next = &uploadQueue;
+        long long now = (long long)time(NULL);
+        for (JournalUpload** candidate = &uploadQueue; *candidate; candidate = &(*candidate)->next) {
+            if ((*candidate)->retryAt <= now) {
+                next = candidate;
+                break;
+            }
+            if ((*candidate)->retryAt < (*next)->retryAt) next = candidate;
+        }
+        if ((*next)->retryAt > now) { // wait for it, unless something else is queued first
+            struct timespec due = { (time_t)(*next)->retryAt, 0 };
+            pthread_cond_timedwait(&uploadQueued, &uploadLock, &due);
+            continue;
+        }
+        JournalUpload* upload = *next;
+        *next = upload->next;
+        pthread_mutex_unlock(&uploadLock);
+
+        cJSON* outcome = runQueuedUpload(upload);
+        if (outcome) {
+            sendEvent(outcome);
+            journalFreeUpload(upload);
+        }
+
+        pthread_mutex_lock(&uploadLock);
+        if (!outcome) { // back on the end of the queue
+            JournalUpload** last = &uploadQueue;
+            while (*last) last = &(*last)->next;
+            upload->next = NULL;
+            *last = upload;
+        }
+    } // next upload
+    pthread_mutex_unlock(&uploadLock);
+    return NULL;
+}
+
+/*
+ * Stops the threads that do things in the background, waiting for them to finish.
+ */
+void jsonStop(void) {
+    pthread_mutex_lock(&prefetchLock);
+    pthread_mutex_lock(&uploadLock);
+    stopping = 1;
+    pthread_cond_broadcast(&prefetchQueued);
+    pthread_cond_broadcast(&uploadQueued);
+    pthread_mutex_unlock(&uploadLock);
+    pthread_mutex_unlock(&prefetchLock);
+    if (prefetchThreadStarted) pthread_join(prefetchThread, NULL);
+    if (uploadThreadStarted) pthread_join(uploadThread, NULL);
+}
+
+/* adds the given uploads to the end of the upload queue */
+static void queueUploads(JournalUpload* uploads) {
+    pthread_mutex_lock(&uploadLock);
+    if (!uploadThreadStarted) {
+        uploadThreadStarted = pthread_create(&uploadThread, NULL, uploadWorker, NULL) == 0;
+    }
+    JournalUpload** last = &uploadQueue;
+    while (*last) last = &(*last)->next;
+    *last = uploads;
+    pthread_cond_signal(&uploadQueued);
+    pthread_mutex_unlock(&uploadLock);
+}
+
+/* queues the given uploads left by earlier processes, except those that needed an authorization,
+ * which isn't journaled - they're given up on, and the caller told */
+static void resumeUploads(JournalUpload* uploads) {
+    JournalUpload* resumed = NULL;
+    JournalUpload** last = &resumed;
+    while (uploads) {
+        JournalUpload* upload = uploads;
+        uploads = upload->next;
+        upload->next = NULL;
+        if (upload->authorized && !upload->authorization) {
+            fprintf(stderr, "Not uploading %s, because its authorization wasn't kept\n", upload->fileName);
+            cJSON* outcome = cJSON_CreateObject();
+            cJSON_AddNumberToObject(outcome, "code", 700);
+            cJSON_AddStringToObject(outcome, "error", "The upload needed authorization, which isn't kept once websendpraat stops.");
+            sendEvent(finishQueuedUpload(upload, outcome));
+            journalFreeUpload(upload);
+        } else {
+            *last = upload;
+            last = &upload->next;
+        }
+    }
+    if (resumed) queueUploads(resumed);
+}
+
+
+/* The most space a script keeps hold of between messages, in bytes - anything bigger is freed when the next message starts */
+#define SCRIPT_KEPT_CAPACITY (1024 * 1024)
+
+/* a Praat script being put together line by line */
+typedef struct {
+    char* text;
+    size_t length;
+    size_t capacity;
+} Script;
+
+/* the script for the message being processed - each thread keeps its own, to reuse for the next message */
+static __thread Script script;
+
+/* empties the script, ready for a new message */
+static void scriptStart(Script* script) {
+    if (script->capacity > SCRIPT_KEPT_CAPACITY) {
+        free(script->text);
+        script->text = NULL;
+        script->capacity = 0;
+    }
+    if (!script->text) {
+        script->capacity = 2048;
+        script->text = malloc(script->capacity);
+    }
+    script->length = 0;
+    script->text[0] = '\0';
+}
+
+/* adds the given line to the end of the script */
+static void scriptAddLine(Script* script, const char* line) {
+    size_t lineLength = strlen(line);
+    size_t needed = script->length + lineLength + 2; // for the newline and the terminator
+    if (needed > script->capacity) {
+        // doubling means that adding lines takes linear time overall
+        size_t capacity = script->capacity;
+        while (capacity < needed) capacity *= 2;
+        script->text = realloc(script->text, capacity);
+        script->capacity = capacity;
+    }
+    if (script->length > 0) script->text[script->length++] = '\n';
+    memcpy(script->text + script->length, line, lineLength + 1);
+    script->length += lineLength;
+}
+
+/* adds the given script line to the end of the script, with any URLs replaced by local file paths */
+static void scriptAddLocalLine(Script* script, const char* line) {
+    char* localLine = rewriteHttpToLocal(line);
+    scriptAddLine(script, localLine);
+    free(localLine);
+}
+
+/* messages can be processed at the same time, but Praat is only sent one script at a time */
+static pthread_mutex_t praatLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* sends the script to Praat, starting Praat if necessary - returns NULL on success, or an error message */
+static char* sendScript(Script* script) {
+    pthread_mutex_lock(&praatLock);
+    char* result = sendpraat (NULL, "Praat", 10, script->text);
+    if (result != NULL) {
+        // maybe praat's simply not running
+        startPraat();
+        // try again
+        result = sendpraat (NULL, "Praat", 10, script->text);
+    }
+    if (result != NULL) { // sendpraat's error message is overwritten by the next call, so keep a copy
+        static __thread char error[1000];
+        snprintf(error, sizeof(error), "%s", result);
+        result = error;
+    }
+    pthread_mutex_unlock(&praatLock);
+    return result;
+}
+
+/* returns the given string member of the given object, or NULL if it's not there */
+static char* stringMember(const cJSON* object, const char* name) {
+    const cJSON* member = cJSON_GetObjectItemCaseSensitive(object, name);
+    return cJSON_IsString(member) ? member->valuestring : NULL;
+}
+
+/* journals the file the given upload message is for, and queues it to be uploaded in the background
+ * - returns 0 on success, or -1 if it couldn't be journaled, in which case it should be uploaded straight away */
+static int queueUpload(const cJSON* json, const char* authorization, const cJSON* clientRef) {
+    JournalUpload* upload = calloc(1, sizeof(JournalUpload));
+    upload->uploadUrl = strdup(stringMember(json, "uploadUrl"));
+    upload->fileParameter = strdup(stringMember(json, "fileParameter"));
+    upload->fileUrl = strdup(stringMember(json, "fileUrl"));
+    const cJSON* otherParameters = cJSON_GetObjectItemCaseSensitive(json, "otherParameters");
+    if (otherParameters) upload->otherParameters = cJSON_PrintUnformatted(otherParameters);
+    if (authorization) upload->authorization = strdup(authorization);
+    if (clientRef != NULL && clientRef->valuestring) upload->clientRef = strdup(clientRef->valuestring);
+    upload->gzip = cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "gzip"));
+    char* filePath = rewriteHttpToLocal(upload->fileUrl);
+    int journaled = journalAdd(upload, filePath);
+    free(filePath);
+    if (journaled != 0) {
+        journalFreeUpload(upload);
+        return -1;
+    }
+    queueUploads(upload);
+    return 0;
+}
 
 /* Processes a JSON message, and returns the JSON reply */
-char* jsonMessage(char* jsonString, void (*downloadProgress)(long,long)) { // TODO leaky?
+char* jsonMessage(char* jsonString, void (*sendProgress)(char* json)) {
     //fprintf (stderr, "Message: %s\n", jsonString);
-    cJSON* reply = cJSON_CreateObject();
     cJSON *json = cJSON_Parse(jsonString);
     if (json == NULL) {
+        cJSON* reply = cJSON_CreateObject();
         cJSON_AddStringToObject(reply, "message", "sendpraat");
         cJSON_AddNumberToObject(reply, "code", 900);
         const char *error_ptr = cJSON_GetErrorPtr();
         if (error_ptr != NULL) {
             char message[1024];
-            sprintf(message, "Error before: %s\n", error_ptr);
-            cJSON_AddStringToObject(reply, "error", message); // TODO does using sprintf like this leak memory?
+            snprintf(message, sizeof(message), "Error before: %s\n", error_ptr);
+            cJSON_AddStringToObject(reply, "error", message);
         } else {
             cJSON_AddStringToObject(reply, "error", "Could not parse JSON.");
         }
+        char* printed = cJSON_Print(reply);
+        cJSON_Delete(reply);
+        return printed;
     }
+    return jsonMessageParsed(json, sendProgress);
+}
+
+/* Processes a JSON message that has already been parsed, deletes it, and returns the JSON reply */
+char* jsonMessageParsed(cJSON* json, void (*sendProgress)(char* json)) {
+    cJSON* reply = cJSON_CreateObject();
     const cJSON* clientRef = cJSON_GetObjectItemCaseSensitive(json, "clientRef");
     char* authorization = NULL;
     const cJSON* authorizationElement = cJSON_GetObjectItemCaseSensitive(json, "authorization");
     if (authorizationElement && cJSON_IsString(authorizationElement) && authorizationElement->valuestring) {
         authorization = authorizationElement->valuestring;
     }
+    long timeout = 0; // milliseconds the message's downloads may take
+    const cJSON* timeoutElement = cJSON_GetObjectItemCaseSensitive(json, "timeout");
+    if (timeoutElement && cJSON_IsNumber(timeoutElement) && timeoutElement->valuedouble > 0) {
+        timeout = (long)timeoutElement->valuedouble;
+    }
 
     const cJSON* message = cJSON_GetObjectItemCaseSensitive(json, "message");
     if (message == NULL || !cJSON_IsString(message) || (message->valuestring == NULL)) {
@@ -49,41 +458,53 @@ char* jsonMessage(char* jsonString, void (*downloadProgress)(long,long)) { // TO
             cJSON_AddNumberToObject(reply, "code", 0);
             cJSON_AddStringToObject(reply, "version", "20180620.1125");
             
+        } else if (strcmp(message->valuestring, "statistics") == 0) {
+            WebStatistics statistics = getWebStatistics();
+            cJSON_AddNumberToObject(reply, "code", 0);
+            cJSON_AddNumberToObject(reply, "transfers", statistics.transfers);
+            cJSON_AddNumberToObject(reply, "connectionsOpened", statistics.connectionsOpened);
+            cJSON_AddNumberToObject(reply, "nameLookupSeconds", statistics.nameLookupSeconds);
+            cJSON_AddNumberToObject(reply, "connectSeconds", statistics.connectSeconds);
+            cJSON_AddNumberToObject(reply, "tlsSeconds", statistics.tlsSeconds);
+            cJSON_AddNumberToObject(reply, "totalSeconds", statistics.totalSeconds);
+            cJSON_AddNumberToObject(reply, "hedges", statistics.hedges);
+            cJSON_AddNumberToObject(reply, "hedgesWon", statistics.hedgesWon);
+            
         } else if (strcmp(message->valuestring, "sendpraat") == 0) {
             const cJSON* arguments = cJSON_GetObjectItemCaseSensitive(json, "sendpraat");
             if (!cJSON_IsArray(arguments)) {
                 cJSON_AddNumberToObject(reply, "code", 501);
                 cJSON_AddStringToObject(reply, "error", "sendpraat is not an array.");
             } else {
-                char message[2048];
-                message[0] = '\0';
+                scriptStart(&script);
                 char* programName = NULL;
-                int argCount = cJSON_GetArraySize(arguments);
+                // on the heap, as a long script would overflow the stack
+                char** lines = malloc((cJSON_GetArraySize(arguments) + 1) * sizeof(char*));
+                int lineCount = 0;
                 char* downloadError = NULL;
-                for (int i = 0; i < argCount; i++) {
-                    const cJSON* argument = cJSON_GetArrayItem(arguments, i);
+                const cJSON* argument = NULL;
+                cJSON_ArrayForEach(argument, arguments) {
                     if (cJSON_IsString(argument) && argument->valuestring != NULL) {
                         if (!programName) { // first argument is program name
                             programName = argument->valuestring;
                         } else { // subsequent arguments are script lines
-                            if (strlen(message) > 0) strcat(message, "\n");
-                            char* line = downloadHttpToLocal(argument->valuestring, authorization, downloadProgress, &downloadError);
-                            strcat(message, line);
-                            free(line);
+                            lines[lineCount++] = argument->valuestring;
                         }
                     } // item is a string
                 } // next argument
+                // download all the files at once
+                ProgressTransfer* progress = progressStart(clientRef && clientRef->valuestring ? clientRef->valuestring : NULL,
+                                                           "download", "Downloading...", "Downloaded.", sendProgress);
+                int downloaded = downloadAllHttpToLocal(lines, lineCount, TRANSFER_INTERACTIVE, timeout, authorization, progress, &downloadError);
+                progressFinish(progress);
+                for (int l = 0; l < lineCount; l++) scriptAddLocalLine(&script, lines[l]);
+                free(lines);
                 if (downloadError) {
                     cJSON_AddStringToObject(reply, "error", downloadError);
-                    cJSON_AddNumberToObject(reply, "code", 600);
+                    cJSON_AddNumberToObject(reply, "code", downloaded == DOWNLOAD_TIMED_OUT ? 601 : 600);
+                    free(downloadError);
                 } else {
-                    char* result = sendpraat (NULL, "Praat", 10, message);
-                    if (result != NULL) {
-                        // maybe praat's simply not running
-                        startPraat();
-                        // try again
-                        result = sendpraat (NULL, "Praat", 10, message);
-                    }
+                    char* result = sendScript(&script);
                     if (result != NULL) {
                         cJSON_AddStringToObject(reply, "error", result);
                         cJSON_AddNumberToObject(reply, "code", 1);
@@ -93,6 +514,35 @@ char* jsonMessage(char* jsonString, void (*downloadProgress)(long,long)) { // TO
                 }
             }
             
+        } else if (strcmp(message->valuestring, "prefetch") == 0) {
+            const cJSON* urls = cJSON_GetObjectItemCaseSensitive(json, "urls");
+            if (!cJSON_IsArray(urls)) {
+                cJSON_AddNumberToObject(reply, "code", 502);
+                cJSON_AddStringToObject(reply, "error", "urls is not an array.");
+            } else {
+                PrefetchJob* job = calloc(1, sizeof(PrefetchJob));
+                job->urls = malloc(cJSON_GetArraySize(urls) * sizeof(char*));
+                const cJSON* url = NULL;
+                cJSON_ArrayForEach(url, urls) {
+                    if (cJSON_IsString(url) && url->valuestring != NULL) {
+                        job->urls[job->urlCount++] = strdup(url->valuestring);
+                    }
+                } // next url
+                if (authorization) job->authorization = strdup(authorization);
+                if (clientRef != NULL && clientRef->valuestring) job->clientRef = strdup(clientRef->valuestring);
+                job->timeout = timeout;
+                cJSON_AddNumberToObject(reply, "code", 0);
+                cJSON_AddNumberToObject(reply, "queued", job->urlCount);
+                if (eventHandler) { // download in the background
+                    queuePrefetch(job);
+                } else { // nobody to tell when it's finished, so do it now
+                    cJSON* outcome = runPrefetch(job, sendProgress);
+                    cJSON_Delete(reply);
+                    reply = outcome;
+                    freePrefetchJob(job);
+                }
+            }
+            
         } else if (strcmp(message->valuestring, "upload") == 0) {
             const cJSON* uploadUrl = cJSON_GetObjectItemCaseSensitive(json, "uploadUrl");
             if (uploadUrl == NULL || !cJSON_IsString(uploadUrl) || (uploadUrl->valuestring == NULL)) {
@@ -115,38 +565,41 @@ char* jsonMessage(char* jsonString, void (*downloadProgress)(long,long)) { // TO
                             cJSON_AddNumberToObject(reply, "code", 501);
                             cJSON_AddStringToObject(reply, "error", "sendpraat is not an array.");
                         } else {
-                            char message[2048];
-                            message[0] = '\0';
+                            scriptStart(&script);
                             char* programName = NULL;
-                            int argCount = cJSON_GetArraySize(arguments);
-                            for (int i = 0; i < argCount; i++) {
-                                const cJSON* argument = cJSON_GetArrayItem(arguments, i);
+                            const cJSON* argument = NULL;
+                            cJSON_ArrayForEach(argument, arguments) {
                                 if (cJSON_IsString(argument) && argument->valuestring != NULL) {
                                     if (!programName) { // first argument is program name
                                         programName = argument->valuestring;
                                     } else { // subsequent arguments are script lines
-                                        if (strlen(message) > 0) strcat(message, "\n");
-                                        char* line = rewriteHttpToLocal(argument->valuestring);
-                                        strcat(message, line);
-                                        free(line);
+                                        scriptAddLocalLine(&script, argument->valuestring);
                                     }
                                 } // item is a string
                             } // next argument
-                            char* result = sendpraat (NULL, "Praat", 10, message);
-                            if (result != NULL) {
-                                // maybe praat's simply not running
-                                startPraat();
-                                // try again
-                                result = sendpraat (NULL, "Praat", 10, message);
-                            }
+                            char* result = sendScript(&script);
                             if (result != NULL) {
                                 cJSON_AddStringToObject(reply, "error", result);
                                 cJSON_AddNumberToObject(reply, "code", 1);
+                            } else if (localCopyUnchanged(fileUrl->valuestring)) {
+                                // the file is just as it was downloaded, so there's nothing to upload
+                                cJSON_AddNumberToObject(reply, "code", 0);
+                                cJSON_AddBoolToObject(reply, "modified", 0);
+                            } else if (cJSON_IsTrue(cJSON_GetObjectItemCaseSensitive(json, "queue")) && eventHandler
+                                       && queueUpload(json, authorization, clientRef) == 0) {
+                                // it'll be uploaded in the background, and an "uploaded" event sent
+                                cJSON_AddNumberToObject(reply, "code", 0);
+                                cJSON_AddBoolToObject(reply, "queued", 1);
                             } else { // sendpraat succeeded
                                 // upload the file
                                 char* filePath = rewriteHttpToLocal(fileUrl->valuestring);
                                 cJSON* uploadResponse = NULL;
-                                char* error = uploadFile(uploadUrl->valuestring, fileParameter->valuestring, filePath, otherParameters, authorization, &uploadResponse);
+                                const cJSON* gzip = cJSON_GetObjectItemCaseSensitive(json, "gzip");
+                                ProgressTransfer* progress = progressStart(clientRef && clientRef->valuestring ? clientRef->valuestring : NULL,
+                                                                           "upload", "Uploading...", "Uploaded.", sendProgress);
+                                char* error = uploadFile(uploadUrl->valuestring, fileParameter->valuestring, filePath, cJSON_IsTrue(gzip),
+                                                         otherParameters, authorization, progress, &uploadResponse);
+                                progressFinish(progress);
                                 free(filePath);
                                 //fprintf(stderr, "finished uploadfile %s\n", error);
                                 if (error || uploadResponse == NULL) {
@@ -157,7 +610,7 @@ char* jsonMessage(char* jsonString, void (*downloadProgress)(long,long)) { // TO
                                     cJSON_AddNumberToObject(reply, "code", 700);
                                 } else {
                                     // discard our pre-prepared JSON object
-                                    free(reply);
+                                    cJSON_Delete(reply);
                                     // and return the one returned by the server
                                     reply = uploadResponse;
                                     cJSON_AddStringToObject(reply, "message", "upload");
@@ -169,6 +622,111 @@ char* jsonMessage(char* jsonString, void (*downloadProgress)(long,long)) { // TO
                     } // fileParameter ok
                 } // fileUrl ok
             } // uploadUrl ok
+        } else if (strcmp(message->valuestring, "uploadBatch") == 0) {
+            const cJSON* uploads = cJSON_GetObjectItemCaseSensitive(json, "uploads");
+            const cJSON* arguments = cJSON_GetObjectItemCaseSensitive(json, "sendpraat");
+            if (!cJSON_IsArray(uploads)) {
+                cJSON_AddNumberToObject(reply, "code", 804);
+                cJSON_AddStringToObject(reply, "error", "uploads is not an array.");
+            } else if (!cJSON_IsArray(arguments)) {
+                cJSON_AddNumberToObject(reply, "code", 501);
+                cJSON_AddStringToObject(reply, "error", "sendpraat is not an array.");
+            } else if (cJSON_GetArraySize(uploads) == 0) { // there's nothing to write or upload
+                cJSON_AddItemToObject(reply, "responses", cJSON_CreateArray());
+                cJSON_AddNumberToObject(reply, "code", 0);
+            } else {
+                // one script writes all the files
+                scriptStart(&script);
+                int programName = 1; // first argument is program name
+                const cJSON* argument = NULL;
+                cJSON_ArrayForEach(argument, arguments) {
+                    if (cJSON_IsString(argument) && argument->valuestring != NULL) {
+                        if (programName) programName = 0;
+                        else scriptAddLocalLine(&script, argument->valuestring);
+                    }
+                } // next argument
+                char* result = sendScript(&script);
+                if (result != NULL) {
+                    cJSON_AddStringToObject(reply, "error", result);
+                    cJSON_AddNumberToObject(reply, "code", 1);
+                } else { // sendpraat succeeded
+                    // work out which files need uploading, and what to say about the others
+                    // (on the heap, as there may be too many for a worker thread's stack)
+                    int uploadCount = cJSON_GetArraySize(uploads);
+                    cJSON** responses = calloc(uploadCount, sizeof(cJSON*));
+                    int* requestOf = malloc(uploadCount * sizeof(int)); // index into requests, or -1 if it's not being uploaded
+                    UploadRequest* requests = calloc(uploadCount, sizeof(UploadRequest));
+                    int requestCount = 0;
+                    int failed = 0;
+                    int u = 0;
+                    const cJSON* upload = NULL;
+                    cJSON_ArrayForEach(upload, uploads) {
+                        char* uploadUrl = stringMember(upload, "uploadUrl");
+                        char* fileParameter = stringMember(upload, "fileParameter");
+                        char* fileUrl = stringMember(upload, "fileUrl");
+                        responses[u] = NULL;
+                        requestOf[u] = -1;
+                        if (!uploadUrl || !fileParameter || !fileUrl) {
+                            responses[u] = cJSON_CreateObject();
+                            cJSON_AddNumberToObject(responses[u], "code", !uploadUrl ? 801 : !fileUrl ? 802 : 803);
+                            cJSON_AddStringToObject(responses[u], "error", !uploadUrl ? "uploadUrl not supplied."
+                                                    : !fileUrl ? "fileUrl not supplied." : "fileParameter not supplied.");
+                            failed++;
+                        } else if (localCopyUnchanged(fileUrl)) {
+                            // the file is just as it was downloaded, so there's nothing to upload
+                            responses[u] = cJSON_CreateObject();
+                            cJSON_AddNumberToObject(responses[u], "code", 0);
+                            cJSON_AddBoolToObject(responses[u], "modified", 0);
+                        } else {
+                            UploadRequest* request = &requests[requestCount];
+                            request->url = uploadUrl;
+                            request->fileParameter = fileParameter;
+                            request->fileName = rewriteHttpToLocal(fileUrl);
+                            request->otherParameters = cJSON_GetObjectItemCaseSensitive(upload, "otherParameters");
+                            requestOf[u] = requestCount++;
+                        }
+                        u++;
+                    } // next upload
+                    
+                    // upload them all at once
+                    if (requestCount > 0) {
+                        const cJSON* gzip = cJSON_GetObjectItemCaseSensitive(json, "gzip");
+                        ProgressTransfer* progress = progressStart(clientRef && clientRef->valuestring ? clientRef->valuestring : NULL,
+                                                                   "upload", "Uploading...", "Uploaded.", sendProgress);
+                        failed += uploadFiles(requests, requestCount, cJSON_IsTrue(gzip), authorization, progress);
+                        progressFinish(progress);
+                    }
+                    
+                    // reply with the server's response to each one, in the order they were asked for
+                    cJSON* responseArray = cJSON_CreateArray();
+                    u = 0;
+                    cJSON_ArrayForEach(upload, uploads) {
+                        if (requestOf[u] >= 0) {
+                            UploadRequest* request = &requests[requestOf[u]];
+                            if (request->response) {
+                                responses[u] = request->response;
+                                cJSON_AddNumberToObject(responses[u], "code", 0);
+                            } else {
+                                responses[u] = cJSON_CreateObject();
+                                cJSON_AddNumberToObject(responses[u], "code", 700);
+                                if (request->error) cJSON_AddStringToObject(responses[u], "error", request->error);
+                            }
+                            free(request->error);
+                            free(request->fileName);
+                        }
+                        char* fileUrl = stringMember(upload, "fileUrl");
+                        if (fileUrl) cJSON_AddStringToObject(responses[u], "fileUrl", fileUrl);
+                        cJSON_AddItemToArray(responseArray, responses[u]);
+                        u++;
+                    } // next upload
+                    free(responses);
+                    free(requestOf);
+                    free(requests);
+                    cJSON_AddItemToObject(reply, "responses", responseArray);
+                    cJSON_AddNumberToObject(reply, "code", failed > 0 ? 700 : 0);
+                }
+            }
+            
         } else { // unknown message
             cJSON_AddNumberToObject(reply, "code", 700);
             cJSON_AddStringToObject(reply, "error", "Unknown message.");
@@ -177,9 +735,9 @@ char* jsonMessage(char* jsonString, void (*downloadProgress)(long,long)) { // TO
     
     if (clientRef != NULL && clientRef->valuestring) {
         cJSON_AddStringToObject(reply, "clientRef", clientRef->valuestring);
-        lastClientRef = clientRef->valuestring;
-    } else {
-        lastClientRef = NULL;
     }
-    return cJSON_Print(reply);
+    char* printed = cJSON_Print(reply);
+    cJSON_Delete(reply);
+    cJSON_Delete(json);
+    return printed;
 }
@@ -12,10 +12,32 @@
 #include <stdio.h>
 #include "cjson/cJSON.h"
 
-/* Processes a JSON message, and returns the JSON reply (which the caller is responsible for freeing) */
-char* jsonMessage(char* json, void (*downloadProgress)(long,long));
+/*
+ * Processes a JSON message, and returns the JSON reply (which the caller is responsible for freeing).
+ * Progress events for the message's downloads are passed to the given function, if it's not NULL.
+ */
+char* jsonMessage(char* json, void (*sendProgress)(char* json));
 
-/* The last clientRef, for passing back with progress notifications */
-static char* lastClientRef;
+/*
+ * Processes a JSON message that has already been parsed, and returns the JSON reply
+ * (which the caller is responsible for freeing). The message is deleted.
+ * Messages may be processed by several threads at the same time.
+ */
+char* jsonMessageParsed(cJSON* json, void (*sendProgress)(char* json));
+
+/*
+ * Sets the function that sends JSON messages back to the caller asynchronously
+ * (e.g. the progress and outcome of a prefetch). It may be called from another thread.
+ * If there's no event handler, work that would otherwise happen in the background is done
+ * before jsonMessage() returns.
+ */
+void jsonSetEventHandler(void (*eventHandler)(char* json));
+
+/*
+ * Stops the threads that prefetch and upload in the background, waiting for them to finish
+ * what they're doing - call stopTransfers() first, so that doesn't take long.
+ * Queued uploads that haven't been done yet are left in the journal for next time.
+ */
+void jsonStop(void);
 
 #endif /* json_h */
@@ -8,6 +8,8 @@
 
 #include "web.h"
 #include "json.h"
+#include "dispatch.h"
+#include "memfile.h"
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +17,11 @@
 // use Paul Boersma's implementation...
 #include "sendpraat.h"
 
+/* Exit statuses on the command line (the codes that JSON replies have don't fit in an exit status) */
+#define EXIT_SEND_FAILED 1
+#define EXIT_DOWNLOAD_FAILED 2
+#define EXIT_DOWNLOAD_TIMED_OUT 3
+
 void printUsage() {
     printf ("Web-enabled sendpraat can be used like standard sendpraat,\n");
     printf (" but supports useing http/https URLs instead of local file paths,\n");
@@ -45,6 +52,10 @@ void printUsage() {
     printf ("   Each line is a separate argument.\n");
     printf ("   Lines that contain spaces should be put inside double quotes.\n");
     printf ("\n");
+    printf ("Exit status:\n");
+    printf ("   0 if the message was sent, %d if it couldn't be sent to the program,\n", EXIT_SEND_FAILED);
+    printf ("   %d if a URL couldn't be downloaded, or %d if downloading took too long.\n", EXIT_DOWNLOAD_FAILED, EXIT_DOWNLOAD_TIMED_OUT);
+    printf ("\n");
     printf ("Examples:\n");
     printf ("\n");
 #if win
@@ -95,7 +106,8 @@ typedef union {
     unsigned char u8[4];
 } U32_U8;
 
-// send a JSON response back to the browser plugin
+// send a JSON response back to the browser plugin - only called by the dispatch writer thread,
+// so responses from different threads aren't interleaved
 void sendResponseNativeMessagingHost(char* jsonResponse) {
     if (jsonResponse != NULL) {
         //fprintf (stderr, "Response: %s\n", jsonResponse);
@@ -106,55 +118,13 @@ void sendResponseNativeMessagingHost(char* jsonResponse) {
         fflush(stdout);
     } // there was a response
 }
-long lastSoFar = 0;
-// download progress callback for Native Messaging Host
-void downloadProgressNativeMessagingHost(long soFar, long total) {
-    int report = FALSE;
-    if ((soFar == 0 || soFar == total) && lastSoFar != soFar) report = TRUE;
-    if ((((soFar - lastSoFar) * 100) / total) > 5) report = TRUE;
-    if (report) {
-        cJSON* reply = cJSON_CreateObject();
-        cJSON_AddStringToObject(reply, "message", "progress");
-        if (soFar < total) {
-            cJSON_AddStringToObject(reply, "string", "Downloading...");
-        } else {
-            cJSON_AddStringToObject(reply, "string", "Downloaded.");
-        }
-        cJSON_AddNumberToObject(reply, "maximum", total);
-        cJSON_AddNumberToObject(reply, "value", soFar);
-        if (lastClientRef) cJSON_AddStringToObject(reply, "clientRef", lastClientRef);
-        char* message = cJSON_Print(reply);
-        sendResponseNativeMessagingHost(message);
-        free(message);
-        lastSoFar = soFar;
-    }
+// progress event handler for command line sendpraatjson:// invocation
+void printProgressJSON(char* json) {
+    printf("%s\n", json);
 }
-// download progress callback for command line sendpraatjson:// invocation
-void downloadProgressJSON(long soFar, long total) {
-    int report = FALSE;
-    if ((soFar == 0 || soFar == total) && lastSoFar != soFar) report = TRUE;
-    if ((((soFar - lastSoFar) * 100) / total) > 5) report = TRUE;
-    if (report) {
-        cJSON* reply = cJSON_CreateObject();
-        cJSON_AddStringToObject(reply, "message", "progress");
-        cJSON_AddNumberToObject(reply, "maximum", total);
-        cJSON_AddNumberToObject(reply, "value", soFar);
-        if (lastClientRef) cJSON_AddStringToObject(reply, "clientRef", lastClientRef);
-        char* message = cJSON_Print(reply);
-        printf("%s\n", message);
-        free(message);
-        lastSoFar = soFar;
-    }
-}
-// download progress callback for standard command line invocation
-void downloadProgress(long soFar, long total) {
-    int report = FALSE;
-    if ((soFar == 0 || soFar == total) && lastSoFar != soFar) report = TRUE;
-    if ((((soFar - lastSoFar) * 100) / total) > 5) report = TRUE;
-    if (report) {
-        printf(".");
-        lastSoFar = soFar;
-    }
+// progress event handler for standard command line invocation
+void printProgressDot(char* json) {
+    printf(".");
 }
 
 // native messaging host - reads messages from stdin and writes responses to stdout
@@ -170,6 +140,10 @@ void nativeMessagingHost() {
     size_t iSize = 0;
     U32_U8 lenBuf;
     lenBuf.u32 = 0;
+    // messages are processed by worker threads, so a slow one doesn't hold up the others
+    dispatchStart(sendResponseNativeMessagingHost);
+    // things like prefetches report back asynchronously
+    jsonSetEventHandler(dispatchResponse);
     while (TRUE) {
         fprintf (stderr, "Waiting for message...\n");
         iSize = fread(lenBuf.u8, 1, 4, stdin);
@@ -177,15 +151,12 @@ void nativeMessagingHost() {
             int iLen = (int)lenBuf.u32;
             // now read the message
             if (iLen > 0) {
-                char* jsonMsg = (char*)malloc(8 * iLen);
+                char* jsonMsg = (char*)malloc(iLen + 1);
                 iSize = fread(jsonMsg, 1, iLen, stdin);
+                jsonMsg[iSize] = '\0'; // the message isn't null-terminated
 
                 // process message
-                lastSoFar = 0;
-                char* jsonResponse = jsonMessage(jsonMsg, downloadProgressNativeMessagingHost);
-                sendResponseNativeMessagingHost(jsonResponse);
-                free(jsonResponse);
-                free(jsonMsg);
+                dispatchMessage(jsonMsg);
             } // there was a message
             
             //uncomment it to debug the messaging
@@ -195,7 +166,12 @@ void nativeMessagingHost() {
              fclose(log);*/
             
         } else { // 4 bytes not read
+            // finish what was asked for before going
+            dispatchFinish();
             fprintf (stderr, "Cleaning up...\n");
+            // background prefetches and uploads must be finished with before their connections are
+            stopTransfers();
+            jsonStop();
             cleanupDownloads();
             fprintf (stderr, "Done.\n");
             exit(1); // take this as a sign to quit
@@ -216,8 +192,7 @@ int main (int argc, char **argv) {
     /* if there's one argument that starts will "sendpraatjson://" */
     if (argc == 2 && strstr(argv[1], "sendpraatjson://") == argv[1]) {
         // process JSON message
-        lastSoFar = 0;
-        char* reply = jsonMessage(argv[1] + 16, &downloadProgressJSON);
+        char* reply = jsonMessage(argv[1] + 16, &printProgressJSON);
         // print the reply directly to stdout
         printf("%s", reply);
         exit(0);
@@ -227,6 +202,8 @@ int main (int argc, char **argv) {
     if ((argc >= 2 && strstr(argv[1], "chrome-extension://") == argv[1]) // Chrome
         || (argc >= 2 && strcmp(argv[1], "@jsendpraat") == 0)            // Firefox
         || (argc >= 3 && strcmp(argv[2], "@jsendpraat") == 0)) {         // Firefox
+        // the host outlives Praat's reading of the files, so they can be kept in memory
+        memoryFilesEnable();
         nativeMessagingHost();
         exit(0);
     }
@@ -253,17 +230,25 @@ int main (int argc, char **argv) {
     /*
      * Create the message string.
      */
-    for (line = iarg; line < argc; line ++) length += strlen (argv [line]) + 1;
+    char* downloadError = NULL;
+    ProgressTransfer* progress = progressStart(NULL, "download", "Downloading...", "Downloaded.", &printProgressDot);
+    int downloaded = downloadAllHttpToLocal(argv + iarg, argc - iarg, TRANSFER_INTERACTIVE, 0, NULL, progress, &downloadError);
+    progressFinish(progress);
+    if (downloadError) {
+        fprintf (stderr, "sendpraat: Download error: %s\n", downloadError);
+        exit(downloaded == DOWNLOAD_TIMED_OUT ? EXIT_DOWNLOAD_TIMED_OUT : EXIT_DOWNLOAD_FAILED);
+    }
+    char* localLines [argc];
+    for (line = iarg; line < argc; line ++) {
+        // local file paths may be longer than the URLs they replace
+        localLines [line] = rewriteHttpToLocal(argv [line]);
+        length += strlen (localLines [line]) + 1;
+    }
     length --;
     message = malloc (length + 1);
     message [0] = '\0';
     for (line = iarg; line < argc; line ++) {
-        char* downloadError = NULL;
-        char* localLine = downloadHttpToLocal(argv [line], NULL, &downloadProgress, &downloadError);
-        if (downloadError) {
-            fprintf (stderr, "sendpraat: Download error: %s\n", downloadError);
-            exit(600);
-        }
+        char* localLine = localLines [line];
         strcat (message, localLine);
         free(localLine); // free memory used to build the local version of the line
         if (line < argc - 1) strcat (message, "\n");
@@ -279,7 +264,7 @@ int main (int argc, char **argv) {
         // try again
         result = sendpraat (NULL, programName, timeOut, message);
         if (result != NULL) {
-            fprintf (stderr, "sendpraat: %s\n", result); exit (1);
+            fprintf (stderr, "sendpraat: %s\n", result); exit (EXIT_SEND_FAILED);
         }
     }
     
@@ -0,0 +1,221 @@
+//
+//  memfile.c
+//  WebSendPraat
+//
+//  Keeps small downloads in anonymous memory instead of on disk (on Linux), so that
+//  short clips and TextGrids can be handed to Praat without any file system I/O.
+//
+//  Praat can open another process's file descriptors through /proc/<pid>/fd/<fd>, but it names
+//  the objects it reads after the file, so each in-memory file is published as a symbolic link
+//  with the file's real name, in its own directory under <cache>/memory.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#if defined (__linux__)
+#define _GNU_SOURCE // for memfd_create()
+#endif
+
+#include "memfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "cache.h"
+
+/* an in-memory file */
+typedef struct MemoryFile {
+    int fd;
+    long long size;                     /* the size reserved for it */
+    char* link;                         /* the path it was published as, or NULL */
+    struct MemoryFile* next;
+} MemoryFile;
+
+static MemoryFile* memoryFiles = NULL;
+static long long memoryFilesTotal = 0;
+static pthread_mutex_t memoryFilesLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t linksTidied = PTHREAD_ONCE_INIT;
+static int memoryFilesEnabled = 0;
+
+/*
+ * Lets downloads be kept in memory.
+ */
+void memoryFilesEnable(void) {
+    memoryFilesEnabled = 1;
+}
+
+/*
+ * Returns the size in bytes up to which downloads are kept in memory - the number of kilobytes
+ * in $WEBSENDPRAAT_MEMORY_FILE_SIZE - or 0 if they're always written to disk.
+ */
+long long memoryFileThreshold(void) {
+#if defined (__linux__)
+    if (!memoryFilesEnabled) return 0;
+    const char* setting = getenv("WEBSENDPRAAT_MEMORY_FILE_SIZE");
+    long long kilobytes = setting && *setting ? atoll(setting) : 0;
+    return kilobytes > 0 ? kilobytes * 1024 : 0;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * Creates an in-memory file for content of the given size, if it's small enough and
+ * there's room for it.
+ */
+int memoryFileCreate(const char* fileName, long long size) {
+#if defined (__linux__)
+    if (size <= 0 || size > memoryFileThreshold()) return -1;
+    pthread_mutex_lock(&memoryFilesLock);
+    int fd = -1;
+    if (memoryFilesTotal + size <= MEMORY_FILES_MAX_TOTAL) {
+        // the name is only for show (in /proc/<pid>/fd)
+        fd = memfd_create(fileName, MFD_CLOEXEC);
+        if (fd < 0) {
+            fprintf(stderr, "Could not create in-memory file: %s\n", strerror(errno));
+        } else {
+            MemoryFile* file = calloc(1, sizeof(MemoryFile));
+            file->fd = fd;
+            file->size = size;
+            file->next = memoryFiles;
+            memoryFiles = file;
+            memoryFilesTotal += size;
+        }
+    }
+    pthread_mutex_unlock(&memoryFilesLock);
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/* deletes the given link to an in-memory file, and the directory it's in */
+static void deleteLink(const char* link) {
+    unlink(link);
+    char* directory = strdup(link);
+    char* lastSlash = strrchr(directory, '/');
+    if (lastSlash) {
+        *lastSlash = '\0';
+        rmdir(directory);
+    }
+    free(directory);
+}
+
+/* deletes the links left behind by processes that have exited without cleaning up */
+static void tidyLinks(void) {
+    char linksDirectory[CACHE_MAX_PATH];
+    if (snprintf(linksDirectory, sizeof(linksDirectory), "%s/memory", cacheDirectory()) >= (int)sizeof(linksDirectory)) return;
+    mkdir(linksDirectory, 0700);
+    DIR* directory = opendir(linksDirectory);
+    if (!directory) return;
+    struct dirent* child;
+    while ((child = readdir(directory))) {
+        // each directory is named <pid>.<fd>
+        char* dot = NULL;
+        long pid = strtol(child->d_name, &dot, 10);
+        if (pid <= 0 || *dot != '.') continue;
+        if (pid == getpid() || kill((pid_t)pid, 0) == 0 || errno != ESRCH) continue; // still running
+        char linkDirectoryName[CACHE_MAX_PATH];
+        if (snprintf(linkDirectoryName, sizeof(linkDirectoryName), "%s/%s", linksDirectory, child->d_name) >= (int)sizeof(linkDirectoryName)) continue;
+        DIR* linkDirectory = opendir(linkDirectoryName);
+        if (!linkDirectory) continue;
+        struct dirent* link;
+        while ((link = readdir(linkDirectory))) {
+            if (strcmp(link->d_name, ".") == 0 || strcmp(link->d_name, "..") == 0) continue;
+            char linkName[CACHE_MAX_PATH];
+            if (snprintf(linkName, sizeof(linkName), "%s/%s", linkDirectoryName, link->d_name) >= (int)sizeof(linkName)) continue;
+            unlink(linkName);
+        }
+        closedir(linkDirectory);
+        rmdir(linkDirectoryName);
+    }
+    closedir(directory);
+}
+
+/* removes the given in-memory file from the list, and closes it - must hold memoryFilesLock */
+static void forget(int fd) {
+    MemoryFile** link = &memoryFiles;
+    while (*link && (*link)->fd != fd) link = &(*link)->next;
+    if (!*link) return;
+    MemoryFile* file = *link;
+    *link = file->next;
+    memoryFilesTotal -= file->size;
+    if (file->link) {
+        deleteLink(file->link);
+        free(file->link);
+    }
+    close(file->fd);
+    free(file);
+}
+
+/*
+ * Makes the given in-memory file readable (and writable) by other processes under the given name,
+ * until memoryFilesRelease() is called.
+ */
+char* memoryFilePublish(int fd, const char* fileName) {
+    pthread_once(&linksTidied, tidyLinks);
+    char* path = malloc(CACHE_MAX_PATH);
+    char target[64];
+    snprintf(path, CACHE_MAX_PATH, "%s/memory/%ld.%d", cacheDirectory(), (long)getpid(), fd);
+    snprintf(target, sizeof(target), "/proc/%ld/fd/%d", (long)getpid(), fd);
+    int published = mkdir(path, 0700) == 0 || errno == EEXIST;
+    size_t length = strlen(path);
+    if (snprintf(path + length, CACHE_MAX_PATH - length, "/%s", fileName) >= (int)(CACHE_MAX_PATH - length)) {
+        fprintf(stderr, "In-memory file name too long: %s\n", fileName);
+        published = 0;
+    }
+    if (published) unlink(path); // in case a previous process with the same pid left it behind
+    published = published && symlink(target, path) == 0;
+    if (!published) fprintf(stderr, "Could not publish in-memory file %s: %s\n", path, strerror(errno));
+    pthread_mutex_lock(&memoryFilesLock);
+    MemoryFile* file = memoryFiles;
+    while (file && file->fd != fd) file = file->next;
+    if (published && file) {
+        file->link = strdup(path);
+    } else {
+        deleteLink(path);
+        forget(fd);
+    }
+    pthread_mutex_unlock(&memoryFilesLock);
+    if (!published || !file) {
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/*
+ * Discards the given in-memory file, which hasn't been published.
+ */
+void memoryFileDiscard(int fd) {
+    pthread_mutex_lock(&memoryFilesLock);
+    forget(fd);
+    pthread_mutex_unlock(&memoryFilesLock);
+}
+
+/*
+ * Discards the in-memory file published with the given path, once nothing will use it again.
+ */
+void memoryFileRelease(const char* path) {
+    pthread_mutex_lock(&memoryFilesLock);
+    MemoryFile* file = memoryFiles;
+    while (file && !(file->link && strcmp(file->link, path) == 0)) file = file->next;
+    if (file) forget(file->fd);
+    pthread_mutex_unlock(&memoryFilesLock);
+}
+
+/*
+ * Discards all in-memory files, including published ones.
+ */
+void memoryFilesRelease(void) {
+    pthread_mutex_lock(&memoryFilesLock);
+    while (memoryFiles) forget(memoryFiles->fd);
+    pthread_mutex_unlock(&memoryFilesLock);
+}
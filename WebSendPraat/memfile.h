@@ -0,0 +1,63 @@
+//
+//  memfile.h
+//  WebSendPraat
+//
+//  Keeps small downloads in anonymous memory instead of on disk (on Linux), so that
+//  short clips and TextGrids can be handed to Praat without any file system I/O.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#ifndef memfile_h
+#define memfile_h
+
+/* The most memory that in-memory files can take up altogether, in bytes */
+#define MEMORY_FILES_MAX_TOTAL (256LL * 1024 * 1024)
+
+/*
+ * Lets downloads be kept in memory. In-memory files are published as links to /proc/<pid>/fd/...,
+ * which disappear when the process exits, so this is only for processes that outlive Praat's
+ * reading of the files (i.e. the native messaging host), not one-shot command line invocations.
+ */
+void memoryFilesEnable(void);
+
+/*
+ * Returns the size in bytes up to which downloads are kept in memory - the number of kilobytes
+ * in $WEBSENDPRAAT_MEMORY_FILE_SIZE - or 0 if they're always written to disk (the default,
+ * the only option on platforms without memfd_create, and always the case unless memoryFilesEnable()
+ * has been called).
+ */
+long long memoryFileThreshold(void);
+
+/*
+ * Creates an in-memory file for content of the given size, if it's small enough and
+ * there's room for it.
+ * Returns a file descriptor to write the content to, or -1 if it should be written to disk instead.
+ */
+int memoryFileCreate(const char* fileName, long long size);
+
+/*
+ * Makes the given in-memory file readable (and writable) by other processes under the given name,
+ * until memoryFilesRelease() is called.
+ * Returns the path to give them, which the caller must free, or NULL on failure
+ * (in which case the in-memory file is discarded).
+ */
+char* memoryFilePublish(int fd, const char* fileName);
+
+/*
+ * Discards the given in-memory file, which hasn't been published.
+ */
+void memoryFileDiscard(int fd);
+
+/*
+ * Discards the in-memory file published with the given path, once nothing will use it again.
+ * Does nothing if the path isn't an in-memory file's.
+ */
+void memoryFileRelease(const char* path);
+
+/*
+ * Discards all in-memory files, including published ones.
+ */
+void memoryFilesRelease(void);
+
+#endif /* memfile_h */
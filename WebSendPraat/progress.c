@@ -0,0 +1,213 @@
+//
+//  progress.c
+//  WebSendPraat
+//
+//  Reports the progress of transfers as JSON "progress" events. Transfers in the same direction
+//  for the same clientRef that are going at the same time are reported together, as one total,
+//  and events are sent at most PROGRESS_MAX_PER_SECOND times a second for each clientRef and direction.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#include "progress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* the transfers in one direction for one clientRef (and destination) that are going at the same time */
+typedef struct ProgressGroup {
+    char* clientRef;                    /* NULL if there isn't one */
+    char* direction;                    /* "download" or "upload" */
+    void (*sendEvent)(char* json);
+    ProgressTransfer* transfers;        /* oldest first */
+    long long finishedSoFar;            /* what transfers that have already finished got through */
+    long long finishedTotal;
+    long long reportedSoFar;            /* what the last event said, if one has been sent */
+    long long reportedTotal;
+    long long reportedAt;               /* when the last event was sent, or 0 if none has been */
+    char* buffer;                       /* where events are written, reused for each one */
+    size_t bufferSize;
+    struct ProgressGroup* next;
+} ProgressGroup;
+
+struct ProgressTransfer {
+    ProgressGroup* group;
+    char* going;
+    char* finished;
+    long long soFar;
+    long long total;
+    struct ProgressTransfer* next;
+};
+
+static ProgressGroup* groups = NULL;
+static pthread_mutex_t progressLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the buffers of groups that have finished, kept for the next ones */
+#define SPARE_BUFFERS 8
+static char* spareBuffers[SPARE_BUFFERS];
+static size_t spareBufferSizes[SPARE_BUFFERS];
+static int spareBufferCount = 0;
+
+/* a clock for timing events, in milliseconds, which doesn't jump when the time of day is changed */
+static long long monotonicMilliseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* the longest the given string can be once it's escaped for JSON */
+static size_t escapedLength(const char* string) {
+    return string ? strlen(string) * 6 : 0;
+}
+
+/* writes the given string to the given buffer as a quoted JSON string, and returns the end */
+static char* writeJsonString(char* buffer, const char* string) {
+    *buffer++ = '"';
+    for (const unsigned char* c = (const unsigned char*)string; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            *buffer++ = '\\';
+            *buffer++ = *c;
+        } else if (*c < 0x20) {
+            buffer += sprintf(buffer, "\\u%04x", *c);
+        } else {
+            *buffer++ = *c;
+        }
+    }
+    *buffer++ = '"';
+    return buffer;
+}
+
+/* sends an event with the group's progress so far - must hold progressLock */
+static void sendProgress(ProgressGroup* group, long long soFar, long long total, const char* label) {
+    size_t needed = 128 + escapedLength(group->direction) + escapedLength(label) + escapedLength(group->clientRef);
+    if (group->bufferSize < needed) {
+        free(group->buffer);
+        group->buffer = malloc(needed);
+        group->bufferSize = needed;
+    }
+    char* end = group->buffer;
+    end += sprintf(end, "{\"message\":\"progress\",\"direction\":");
+    end = writeJsonString(end, group->direction);
+    end += sprintf(end, ",\"string\":");
+    end = writeJsonString(end, label);
+    end += sprintf(end, ",\"maximum\":%lld,\"value\":%lld", total, soFar);
+    if (group->clientRef) {
+        end += sprintf(end, ",\"clientRef\":");
+        end = writeJsonString(end, group->clientRef);
+    }
+    strcpy(end, "}");
+    group->sendEvent(group->buffer);
+}
+
+/* whether the given clientRefs are the same */
+static int sameClientRef(const char* clientRef, const char* otherClientRef) {
+    if (!clientRef || !otherClientRef) return clientRef == otherClientRef;
+    return strcmp(clientRef, otherClientRef) == 0;
+}
+
+/*
+ * Starts reporting the progress of a transfer in the given direction for the given clientRef (which may be NULL).
+ */
+ProgressTransfer* progressStart(const char* clientRef, const char* direction, const char* going, const char* finished, void (*sendEvent)(char* json)) {
+    if (!sendEvent) return NULL;
+    ProgressTransfer* transfer = calloc(1, sizeof(ProgressTransfer));
+    transfer->going = strdup(going);
+    transfer->finished = strdup(finished);
+    pthread_mutex_lock(&progressLock);
+    ProgressGroup* group = groups;
+    while (group && !(group->sendEvent == sendEvent && strcmp(group->direction, direction) == 0
+                      && sameClientRef(group->clientRef, clientRef))) {
+        group = group->next;
+    }
+    if (!group) {
+        group = calloc(1, sizeof(ProgressGroup));
+        if (clientRef) group->clientRef = strdup(clientRef);
+        group->direction = strdup(direction);
+        group->sendEvent = sendEvent;
+        if (spareBufferCount > 0) {
+            spareBufferCount--;
+            group->buffer = spareBuffers[spareBufferCount];
+            group->bufferSize = spareBufferSizes[spareBufferCount];
+        }
+        group->next = groups;
+        groups = group;
+    }
+    transfer->group = group;
+    ProgressTransfer** last = &group->transfers;
+    while (*last) last = &(*last)->next;
+    *last = transfer;
+    pthread_mutex_unlock(&progressLock);
+    return transfer;
+}
+
+/*
+ * Records how far the given transfer has got, and sends an event if it's time for one.
+ */
+void progressUpdate(ProgressTransfer* transfer, long long soFar, long long total) {
+    if (!transfer) return;
+    pthread_mutex_lock(&progressLock);
+    transfer->soFar = soFar;
+    transfer->total = total;
+    ProgressGroup* group = transfer->group;
+    long long groupSoFar = group->finishedSoFar;
+    long long groupTotal = group->finishedTotal;
+    for (ProgressTransfer* counted = group->transfers; counted; counted = counted->next) {
+        groupSoFar += counted->soFar;
+        groupTotal += counted->total;
+    }
+    int complete = groupTotal > 0 && groupSoFar >= groupTotal;
+    long long now = monotonicMilliseconds();
+    int due;
+    if (!group->reportedAt) { // always say when it starts
+        due = 1;
+    } else if (groupSoFar == group->reportedSoFar && groupTotal == group->reportedTotal) {
+        due = 0;
+    } else { // always say when it's finished, otherwise don't say it too often
+        due = complete || now - group->reportedAt >= 1000 / PROGRESS_MAX_PER_SECOND;
+    }
+    if (due) {
+        // events are labelled according to the transfer that's been going longest
+        ProgressTransfer* oldest = group->transfers;
+        sendProgress(group, groupSoFar, groupTotal, complete ? oldest->finished : oldest->going);
+        group->reportedSoFar = groupSoFar;
+        group->reportedTotal = groupTotal;
+        group->reportedAt = now;
+    }
+    pthread_mutex_unlock(&progressLock);
+}
+
+/*
+ * Stops reporting the progress of the given transfer, and frees it.
+ */
+void progressFinish(ProgressTransfer* transfer) {
+    if (!transfer) return;
+    pthread_mutex_lock(&progressLock);
+    ProgressGroup* group = transfer->group;
+    ProgressTransfer** link = &group->transfers;
+    while (*link != transfer) link = &(*link)->next;
+    *link = transfer->next;
+    group->finishedSoFar += transfer->soFar;
+    group->finishedTotal += transfer->total;
+    if (!group->transfers) { // nothing else is going for this clientRef, so the next transfer starts afresh
+        ProgressGroup** groupLink = &groups;
+        while (*groupLink != group) groupLink = &(*groupLink)->next;
+        *groupLink = group->next;
+        free(group->clientRef);
+        free(group->direction);
+        if (group->buffer && spareBufferCount < SPARE_BUFFERS) {
+            spareBuffers[spareBufferCount] = group->buffer;
+            spareBufferSizes[spareBufferCount] = group->bufferSize;
+            spareBufferCount++;
+        } else {
+            free(group->buffer);
+        }
+        free(group);
+    }
+    pthread_mutex_unlock(&progressLock);
+    free(transfer->going);
+    free(transfer->finished);
+    free(transfer);
+}
@@ -0,0 +1,46 @@
+//
+//  progress.h
+//  WebSendPraat
+//
+//  Reports the progress of transfers as JSON "progress" events. Transfers in the same direction
+//  for the same clientRef that are going at the same time are reported together, as one total,
+//  and events are sent at most PROGRESS_MAX_PER_SECOND times a second for each clientRef and direction.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#ifndef progress_h
+#define progress_h
+
+/* The most progress events sent per second for each clientRef and direction (apart from the first and last) */
+#define PROGRESS_MAX_PER_SECOND 10
+
+/* A transfer whose progress is being reported */
+typedef struct ProgressTransfer ProgressTransfer;
+
+/*
+ * Starts reporting the progress of a transfer in the given direction ("download" or "upload")
+ * for the given clientRef (which may be NULL),
+ * labelling events with the given strings while it's going and once it's finished,
+ * e.g. "Downloading..." and "Downloaded.".
+ * Downloads and uploads for the same clientRef are reported separately.
+ * Events are passed to the given function, which must not keep the string it's given.
+ * It may be called from any thread that updates a transfer, but only one at a time.
+ * Returns NULL if there's no function to pass events to.
+ */
+ProgressTransfer* progressStart(const char* clientRef, const char* direction, const char* going, const char* finished, void (*sendEvent)(char* json));
+
+/*
+ * Records how far the given transfer has got, and sends an event if it's time for one.
+ * The transfer may be NULL, in which case nothing is reported.
+ */
+void progressUpdate(ProgressTransfer* transfer, long long soFar, long long total);
+
+/*
+ * Stops reporting the progress of the given transfer, which may be NULL, and frees it.
+ * What it transferred still counts towards its clientRef's total until all the transfers
+ * for that clientRef have finished.
+ */
+void progressFinish(ProgressTransfer* transfer);
+
+#endif /* progress_h */
@@ -0,0 +1,124 @@
+//
+//  wav.c
+//  WebSendPraat
+//
+//  Just enough RIFF/WAVE handling to extract a time window from a remote WAV file
+//  without downloading the whole thing.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#include "wav.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* reads a little-endian 16-bit number */
+static unsigned int readShort(const unsigned char* bytes) {
+    return bytes[0] | (bytes[1] << 8);
+}
+
+/* reads a little-endian 32-bit number */
+static unsigned long readLong(const unsigned char* bytes) {
+    return (unsigned long)bytes[0] | ((unsigned long)bytes[1] << 8)
+        | ((unsigned long)bytes[2] << 16) | ((unsigned long)bytes[3] << 24);
+}
+
+/* writes a little-endian 32-bit number */
+static void writeLong(unsigned char* bytes, unsigned long value) {
+    bytes[0] = value & 0xff;
+    bytes[1] = (value >> 8) & 0xff;
+    bytes[2] = (value >> 16) & 0xff;
+    bytes[3] = (value >> 24) & 0xff;
+}
+
+/*
+ * Parses the given start of a WAV file.
+ * Returns 0 if the layout was determined, a positive number of bytes if the header is longer
+ * than the given bytes (so more need to be fetched), or -1 if it's not a WAV file.
+ */
+long long wavParseHeader(const unsigned char* header, size_t length, WavLayout* layout) {
+    memset(layout, 0, sizeof(WavLayout));
+    if (length < 12) return 12;
+    if (memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) return -1;
+
+    // walk through the chunks until we find the samples
+    long long offset = 12;
+    while (1) {
+        if (offset + 8 > length) return offset + 8;
+        const unsigned char* chunk = header + offset;
+        unsigned long chunkSize = readLong(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            if (offset + 8 + chunkSize > length) return offset + 8 + chunkSize;
+            if (chunkSize < 16) return -1;
+            layout->fmtOffset = offset;
+            layout->fmtLength = 8 + chunkSize;
+            layout->sampleRate = readLong(chunk + 12);
+            layout->blockAlign = readShort(chunk + 20);
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!layout->fmtLength || layout->sampleRate <= 0 || layout->blockAlign <= 0) return -1;
+            layout->dataOffset = offset + 8;
+            layout->dataSize = chunkSize;
+            return 0;
+        }
+        offset += 8 + chunkSize + (chunkSize & 1); // chunks are padded to an even length
+    }
+}
+
+/*
+ * Parses a media fragment time range, e.g. "#t=12.5,17.0", "#t=npt:12.5" or "#t=,17", on the end of the given URL.
+ * Returns 1 if there's a time range, in which case *start and *end are set
+ * (*end is -1 if the range goes to the end of the file), or 0 otherwise.
+ */
+int wavParseTimeFragment(const char* url, double* start, double* end) {
+    const char* fragment = strstr(url, "#t=");
+    if (!fragment) return 0;
+    fragment += 3;
+    if (strncmp(fragment, "npt:", 4) == 0) fragment += 4;
+    char* rest;
+    *start = strtod(fragment, &rest);
+    if (rest == fragment) *start = 0; // e.g. "#t=,17"
+    *end = -1;
+    if (*rest == ',') {
+        const char* endString = rest + 1;
+        *end = strtod(endString, &rest);
+        if (rest == endString) return 0;
+    }
+    if (*rest != '\0' || *start < 0 || (*end >= 0 && *end <= *start)) return 0;
+    return 1;
+}
+
+/*
+ * Works out which bytes of sample data the given time range covers.
+ */
+int wavExcerptBytes(const WavLayout* layout, double start, double end, long long* first, long long* last) {
+    long long frames = layout->dataSize / layout->blockAlign;
+    // times aren't negative, so truncating rounds the start down, and the end is rounded up by hand
+    long long startFrame = (long long)(start * layout->sampleRate);
+    long long endFrame = frames;
+    if (end >= 0) {
+        endFrame = (long long)(end * layout->sampleRate);
+        if (endFrame < end * layout->sampleRate) endFrame++;
+    }
+    if (endFrame > frames) endFrame = frames;
+    if (startFrame >= endFrame) return -1;
+    *first = layout->dataOffset + startFrame * layout->blockAlign;
+    *last = layout->dataOffset + endFrame * layout->blockAlign - 1;
+    return 0;
+}
+
+/*
+ * Makes the header of a WAV file with the given number of bytes of sample data,
+ * copying the format from the given header of the original file.
+ */
+long wavMakeHeader(unsigned char* buffer, size_t size, const unsigned char* header, const WavLayout* layout, long long dataSize) {
+    long length = 12 + layout->fmtLength + 8;
+    if ((size_t)length > size) return -1;
+    memcpy(buffer, "RIFFxxxxWAVE", 12);
+    writeLong(buffer + 4, (unsigned long)(4 + layout->fmtLength + 8 + dataSize));
+    memcpy(buffer + 12, header + layout->fmtOffset, layout->fmtLength);
+    unsigned char* data = buffer + 12 + layout->fmtLength;
+    memcpy(data, "data", 4);
+    writeLong(data + 4, (unsigned long)dataSize);
+    return length;
+}
@@ -0,0 +1,56 @@
+//
+//  wav.h
+//  WebSendPraat
+//
+//  Just enough RIFF/WAVE handling to extract a time window from a remote WAV file
+//  without downloading the whole thing.
+//
+//  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+//
+
+#ifndef wav_h
+#define wav_h
+
+#include <stddef.h>
+
+/* How many bytes of a WAV file to fetch first, in the hope that they include the whole header */
+#define WAV_HEADER_GUESS 4096
+
+/* Where things are in a WAV file */
+typedef struct {
+    long long fmtOffset;    /* offset of the "fmt " chunk (including its 8-byte chunk header) */
+    long fmtLength;         /* length of the "fmt " chunk (including its 8-byte chunk header) */
+    long long dataOffset;   /* offset of the first sample */
+    long long dataSize;     /* number of bytes of samples */
+    long sampleRate;        /* frames per second */
+    int blockAlign;         /* bytes per frame */
+} WavLayout;
+
+/*
+ * Parses the given start of a WAV file.
+ * Returns 0 if the layout was determined, a positive number of bytes if the header is longer
+ * than the given bytes (so more need to be fetched), or -1 if it's not a WAV file.
+ */
+long long wavParseHeader(const unsigned char* header, size_t length, WavLayout* layout);
+
+/*
+ * Parses a media fragment time range, e.g. "#t=12.5,17.0", "#t=npt:12.5" or "#t=,17", on the end of the given URL.
+ * Returns 1 if there's a time range, in which case *start and *end are set
+ * (*end is -1 if the range goes to the end of the file), or 0 otherwise.
+ */
+int wavParseTimeFragment(const char* url, double* start, double* end);
+
+/*
+ * Works out which bytes of sample data the given time range covers.
+ * Sets *first and *last (inclusive) to file offsets. Returns 0 on success, or -1 if the range is empty.
+ */
+int wavExcerptBytes(const WavLayout* layout, double start, double end, long long* first, long long* last);
+
+/*
+ * Makes the header of a WAV file with the given number of bytes of sample data,
+ * copying the format from the given header of the original file.
+ * Returns the number of bytes put in the buffer, or -1 if it's too small.
+ */
+long wavMakeHeader(unsigned char* buffer, size_t size, const unsigned char* header, const WavLayout* layout, long long dataSize);
+
+#endif /* wav_h */
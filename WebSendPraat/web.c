@@ -9,185 +9,1596 @@
 #include "web.h"
 
 #include <curl/curl.h>
+#include <zlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "c_hashmap/hashmap.h"
+#include "cache.h"
+#include "wav.h"
+#include "digest.h"
+#include "memfile.h"
+
+/* where a URL was downloaded to, and when the server last confirmed it was current */
+typedef struct {
+    char* url;                          /* the map's key, which is freed with it */
+    char* path;
+    time_t validated;
+    unsigned long long contentHash;     /* the hash of its content when it was downloaded (see CacheHasher) */
+} LocalFile;
+
+/* files downloaded recently enough are used without asking the server again */
+#define FRESHNESS_SECONDS 30
 
 static map_t urlToLocal = NULL;
-char statusErrorBuffer[1024];
+static pthread_mutex_t urlToLocalLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Connections, DNS lookups and TLS sessions are shared between all transfers,
+ * so repeat requests to the same server don't have to set them up again.
+ */
+static pthread_once_t webInitialized = PTHREAD_ONCE_INIT;
+static CURLSH* share = NULL;
+static pthread_key_t multiKey; /* each thread that downloads has its own multi handle */
+static pthread_mutex_t shareLocks[CURL_LOCK_DATA_LAST];
+
+/* how many idle connections are kept - otherwise curl only keeps 4 for each transfer still going,
+ * so finishing a batch of transfers closes connections the next batch could have used */
+#define MAX_IDLE_CONNECTIONS 32
+
+/* idle curl handles, kept for reuse */
+#define HANDLE_POOL_SIZE 8
+static CURL* handlePool[HANDLE_POOL_SIZE];
+static int handlePoolCount = 0;
+static pthread_mutex_t handlePoolLock = PTHREAD_MUTEX_INITIALIZER;
+
+static WebStatistics statistics;
+static pthread_mutex_t statisticsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* set by stopTransfers(), when the process is about to exit */
+static volatile int transfersStopped = 0;
+
+static void lockShare(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr) {
+    pthread_mutex_lock(&shareLocks[data]);
+}
+
+static void unlockShare(CURL *handle, curl_lock_data data, void *userptr) {
+    pthread_mutex_unlock(&shareLocks[data]);
+}
+
+/* sets up the shared curl state - called once */
+static void initWeb(void) {
+    curl_global_init(CURL_GLOBAL_ALL);
+    for (int l = 0; l < CURL_LOCK_DATA_LAST; l++) pthread_mutex_init(&shareLocks[l], NULL);
+    share = curl_share_init();
+    curl_share_setopt(share, CURLSHOPT_LOCKFUNC, lockShare);
+    curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, unlockShare);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    pthread_key_create(&multiKey, (void (*)(void*))curl_multi_cleanup);
+}
+
+/* returns the calling thread's multi handle, creating it if necessary */
+static CURLM* threadMulti(void) {
+    pthread_once(&webInitialized, initWeb);
+    CURLM* multi = pthread_getspecific(multiKey);
+    if (!multi) {
+        multi = curl_multi_init();
+        // requests to the same HTTP/2 server share one connection
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)MAX_IDLE_CONNECTIONS);
+        pthread_setspecific(multiKey, multi);
+    }
+    return multi;
+}
+
+/* returns a curl handle that uses the shared state, reusing an idle one if possible */
+static CURL* acquireHandle(void) {
+    pthread_once(&webInitialized, initWeb);
+    CURL* curl = NULL;
+    pthread_mutex_lock(&handlePoolLock);
+    if (handlePoolCount > 0) curl = handlePool[--handlePoolCount];
+    pthread_mutex_unlock(&handlePoolLock);
+    if (!curl) curl = curl_easy_init();
+    if (curl) curl_easy_setopt(curl, CURLOPT_SHARE, share);
+    return curl;
+}
+
+/* returns the given curl handle to the pool, after recording its timings */
+static void releaseHandle(CURL* curl) {
+    long connects = 0;
+    double nameLookup = 0, connect = 0, appConnect = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &nameLookup);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appConnect);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+    pthread_mutex_lock(&statisticsLock);
+    statistics.transfers++;
+    statistics.connectionsOpened += connects;
+    statistics.nameLookupSeconds += nameLookup;
+    if (connect > nameLookup) statistics.connectSeconds += connect - nameLookup;
+    if (appConnect > connect) statistics.tlsSeconds += appConnect - connect;
+    statistics.totalSeconds += total;
+    pthread_mutex_unlock(&statisticsLock);
+    
+    // resetting options keeps the handle's caches
+    curl_easy_reset(curl);
+    pthread_mutex_lock(&handlePoolLock);
+    if (handlePoolCount < HANDLE_POOL_SIZE) {
+        handlePool[handlePoolCount++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&handlePoolLock);
+    if (curl) curl_easy_cleanup(curl);
+}
+
+/*
+ * Returns counters for all transfers so far.
+ */
+WebStatistics getWebStatistics(void) {
+    pthread_mutex_lock(&statisticsLock);
+    WebStatistics copy = statistics;
+    pthread_mutex_unlock(&statisticsLock);
+    return copy;
+}
+
+/*
+ * Transfers are scheduled by priority: there's a limit on how many transfers can use the same
+ * server at once, and transfers in the background can only use some of them, so that there's
+ * always room for a transfer the user is waiting for. While there are any of those, background
+ * transfers are paused so that they get all the bandwidth.
+ * Servers that speak HTTP/2 multiplex transfers over one connection, so they can take more at once.
+ */
+#define MAX_HOST_TRANSFERS 6
+#define MAX_MULTIPLEXED_HOST_TRANSFERS 16
+#define MAX_BACKGROUND_HOST_TRANSFERS 2
+#define MAX_MULTIPLEXED_BACKGROUND_HOST_TRANSFERS 6
+
+/* how many transfers are using a server, and how quickly it usually responds */
+typedef struct HostTransfers {
+    char* host;
+    int active;
+    double firstByteSeconds;            /* average time until the content starts arriving, or 0 if unknown */
+    double bytesPerSecond;              /* average rate the content arrives at, or 0 if unknown */
+    int multiplexed;                    /* whether its last response came over HTTP/2 */
+    struct HostTransfers* next;
+} HostTransfers;
+
+static HostTransfers* hostTransfers = NULL;
+static int interactiveBatches = 0;      /* how many requests the user is waiting for */
+static pthread_mutex_t schedulerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t schedulerChanged = PTHREAD_COND_INITIALIZER;
+
+/* copies the scheme, host and port of the given URL */
+static void hostOf(const char* url, char* host, size_t size) {
+    const char* start = strstr(url, "://");
+    start = start ? start + 3 : url;
+    size_t length = (start - url) + strcspn(start, "/?#");
+    if (length >= size) length = size - 1;
+    strncpy(host, url, length);
+    host[length] = '\0';
+}
+
+/* finds what we know about the given URL's server, adding it if it's new - must hold schedulerLock */
+static HostTransfers* findHost(const char* url) {
+    char host[256];
+    hostOf(url, host, sizeof(host));
+    HostTransfers* transfers = hostTransfers;
+    while (transfers && strcmp(transfers->host, host) != 0) transfers = transfers->next;
+    if (!transfers) {
+        transfers = calloc(1, sizeof(HostTransfers));
+        transfers->host = strdup(host);
+        transfers->next = hostTransfers;
+        hostTransfers = transfers;
+    }
+    return transfers;
+}
+
+/* takes one of the given URL's server's transfer slots if there's one free - returns 1 if so */
+static int acquireHostSlot(const char* url, TransferPriority priority) {
+    pthread_mutex_lock(&schedulerLock);
+    HostTransfers* transfers = findHost(url);
+    int limit = priority == TRANSFER_INTERACTIVE
+        ? (transfers->multiplexed ? MAX_MULTIPLEXED_HOST_TRANSFERS : MAX_HOST_TRANSFERS)
+        : (transfers->multiplexed ? MAX_MULTIPLEXED_BACKGROUND_HOST_TRANSFERS : MAX_BACKGROUND_HOST_TRANSFERS);
+    int acquired = transfers->active < limit;
+    if (acquired) transfers->active++;
+    pthread_mutex_unlock(&schedulerLock);
+    return acquired;
+}
+
+/* gives back a slot taken by acquireHostSlot() */
+static void releaseHostSlot(const char* url) {
+    pthread_mutex_lock(&schedulerLock);
+    findHost(url)->active--;
+    pthread_cond_broadcast(&schedulerChanged);
+    pthread_mutex_unlock(&schedulerLock);
+}
+
+/* records how quickly the given URL's server responded to a transfer
+ * (bytesPerSecond is 0 if the transfer was too short to tell), and whether it used HTTP/2 */
+static void recordHostTiming(const char* url, double firstByteSeconds, double bytesPerSecond, int multiplexed) {
+    pthread_mutex_lock(&schedulerLock);
+    HostTransfers* transfers = findHost(url);
+    transfers->multiplexed = multiplexed;
+    // moving averages, so that they follow changes in the server's load or the network
+    transfers->firstByteSeconds = transfers->firstByteSeconds > 0
+        ? 0.75 * transfers->firstByteSeconds + 0.25 * firstByteSeconds : firstByteSeconds;
+    if (bytesPerSecond > 0) {
+        transfers->bytesPerSecond = transfers->bytesPerSecond > 0
+            ? 0.75 * transfers->bytesPerSecond + 0.25 * bytesPerSecond : bytesPerSecond;
+    }
+    pthread_mutex_unlock(&schedulerLock);
+}
+
+/* gets how quickly the given URL's server usually responds - either may be 0 if we don't know yet */
+static void hostTiming(const char* url, double* firstByteSeconds, double* bytesPerSecond) {
+    pthread_mutex_lock(&schedulerLock);
+    HostTransfers* transfers = findHost(url);
+    *firstByteSeconds = transfers->firstByteSeconds;
+    *bytesPerSecond = transfers->bytesPerSecond;
+    pthread_mutex_unlock(&schedulerLock);
+}
+
+/* works out the time the given number of milliseconds from now, for pthread_cond_timedwait() */
+static void timeAfter(long long milliseconds, struct timespec* until) {
+    clock_gettime(CLOCK_REALTIME, until);
+    until->tv_sec += milliseconds / 1000;
+    until->tv_nsec += (milliseconds % 1000) * 1000000L;
+    if (until->tv_nsec >= 1000000000L) {
+        until->tv_sec++;
+        until->tv_nsec -= 1000000000L;
+    }
+}
+
+/* waits until something changes that might let a waiting transfer go ahead, or for the given time */
+static void waitForScheduler(long milliseconds) {
+    struct timespec until;
+    timeAfter(milliseconds, &until);
+    pthread_mutex_lock(&schedulerLock);
+    pthread_cond_timedwait(&schedulerChanged, &schedulerLock, &until);
+    pthread_mutex_unlock(&schedulerLock);
+}
+
+/* registers a request the user is waiting for, or its end */
+static void setInteractive(int starting) {
+    pthread_mutex_lock(&schedulerLock);
+    interactiveBatches += starting ? 1 : -1;
+    pthread_cond_broadcast(&schedulerChanged);
+    pthread_mutex_unlock(&schedulerLock);
+}
+
+/* whether a transfer with the given priority should make way for others */
+static int shouldYield(TransferPriority priority) {
+    if (priority == TRANSFER_INTERACTIVE) return 0;
+    pthread_mutex_lock(&schedulerLock);
+    int yield = interactiveBatches > 0;
+    pthread_mutex_unlock(&schedulerLock);
+    return yield;
+}
+
+/* what we need to know from the response headers */
+typedef struct {
+    char fileName[256];     /* the file name, if the server suggests one */
+    char etag[256];
+    char lastModified[128];
+    long status;            /* status code of the (last) response */
+    long long rangeStart;   /* first byte of a partial (206) response */
+    long long contentLength;    /* bytes in the body of the response, or -1 if unknown */
+    int contentEncoded;     /* whether the content was compressed for transfer */
+    DigestAlgorithm digestAlgorithm;                /* how the server's digest of the content was computed, if it sent one */
+    unsigned char digest[DIGEST_MAX_LENGTH];        /* the server's digest of the content */
+} ResponseHeaders;
 
 /* header callback */
 size_t header_callback(char *buffer,   size_t size,   size_t nitems,   void *userdata)
 {
+    ResponseHeaders* headers = userdata;
     char header[nitems * size + 1];
     strncpy(header, buffer, nitems * size);
+    header[nitems * size] = '\0';
     char* newline = strchr(header, '\n');
     if (newline) *newline = '\0';
     newline = strchr(header, '\r');
     if (newline) *newline = '\0';
-    char* filenamespec = strstr(header, "filename=");
-    if (filenamespec) {
-        strcpy(userdata, filenamespec + 9);
+    if (strncmp(header, "HTTP/", 5) == 0) {
+        // start of a new response (e.g. after a redirect) so forget the validators of the last one
+        headers->etag[0] = '\0';
+        headers->lastModified[0] = '\0';
+        headers->rangeStart = -1;
+        headers->contentLength = -1;
+        headers->contentEncoded = 0;
+        headers->digestAlgorithm = DIGEST_NONE;
+        char* space = strchr(header, ' ');
+        headers->status = space ? atol(space + 1) : 0;
+    } else if (strncasecmp(header, "Content-Range: bytes ", 21) == 0) {
+        headers->rangeStart = atoll(header + 21);
+    } else if (strncasecmp(header, "ETag: ", 6) == 0) {
+        snprintf(headers->etag, sizeof(headers->etag), "%s", header + 6);
+    } else if (strncasecmp(header, "Last-Modified: ", 15) == 0) {
+        snprintf(headers->lastModified, sizeof(headers->lastModified), "%s", header + 15);
+    } else if (strncasecmp(header, "Content-Length: ", 16) == 0) {
+        headers->contentLength = atoll(header + 16);
+    } else if (strncasecmp(header, "Content-Encoding: ", 18) == 0) {
+        headers->contentEncoded = strcasecmp(header + 18, "identity") != 0;
+    } else if (strncasecmp(header, "Digest: ", 8) == 0) {
+        unsigned char digest[DIGEST_MAX_LENGTH];
+        DigestAlgorithm algorithm = digestParseHeader(header + 8, digest);
+        if (algorithm > headers->digestAlgorithm) {
+            headers->digestAlgorithm = algorithm;
+            memcpy(headers->digest, digest, digestLength(algorithm));
+        }
+    } else if (strncasecmp(header, "Content-MD5: ", 13) == 0) {
+        unsigned char digest[DIGEST_MAX_LENGTH];
+        if (headers->digestAlgorithm == DIGEST_NONE
+            && digestDecodeBase64(header + 13, digest, sizeof(digest)) == (int)digestLength(DIGEST_MD5)) {
+            headers->digestAlgorithm = DIGEST_MD5;
+            memcpy(headers->digest, digest, digestLength(DIGEST_MD5));
+        }
+    } else {
+        char* filenamespec = strstr(header, "filename=");
+        if (filenamespec) {
+            snprintf(headers->fileName, sizeof(headers->fileName), "%s", filenamespec + 9);
+        }
     }
     return nitems * size;
 }
 
-/* download progress callback */
+/* where downloaded content goes */
+typedef struct {
+    FILE* file;                 /* NULL if it isn't open */
+    CacheHasher hasher;         /* content hash of everything in the file */
+    long long offset;           /* bytes already in the file when the transfer started */
+    long long written;          /* bytes written since */
+    int rangeOnly;              /* whether only a partial (206) response will do */
+    int verifying;              /* whether the content is being checked against the server's digest */
+    Digest digest;
+    ResponseHeaders* headers;
+    const char* tempfilename;   /* the temporary file the content is written to */
+    int memoryAllowed;          /* whether the content may be kept in memory instead, if it's small enough */
+    int inMemory;               /* whether it's going to an in-memory file rather than the temporary file */
+    int memoryFile;             /* the in-memory file, if so */
+} DownloadSink;
+
+/* switches the sink to writing an in-memory file, if content of the given size is small enough
+ * - returns whether it did */
+static int writeToMemory(DownloadSink* sink, long long size) {
+    int fd = memoryFileCreate(sink->headers->fileName, size);
+    if (fd < 0) return 0;
+    // a copy of the descriptor, so closing the stream leaves the in-memory file open
+    int copy = dup(fd);
+    FILE* memory = copy >= 0 ? fdopen(copy, "wb") : NULL;
+    if (!memory) {
+        if (copy >= 0) close(copy);
+        memoryFileDiscard(fd);
+        return 0;
+    }
+    // nothing has been written to the temporary file yet, so it's not needed
+    if (sink->file) fclose(sink->file);
+    cacheDiscardPartial(sink->tempfilename);
+    sink->file = memory;
+    sink->inMemory = 1;
+    sink->memoryFile = fd;
+    return 1;
+}
+
+/* write callback - saves content to the file, hashing it as it goes (and checking it against
+ * the server's digest, if it sent one for the whole of the content we're getting) */
+static size_t write_download(char *in, size_t size, size_t nmemb, void *userdata)
+{
+    DownloadSink* sink = userdata;
+    if (sink->rangeOnly && sink->headers->status != 206) return 0;
+    if (sink->offset > 0 && sink->written == 0) { // we asked for the rest of a partial download
+        if (sink->headers->status == 200) {
+            // the server sent the whole thing instead, so start again
+            if (fflush(sink->file) != 0 || ftruncate(fileno(sink->file), 0) != 0 || fseek(sink->file, 0, SEEK_SET) != 0) return 0;
+            sink->offset = 0;
+            cacheHasherStart(&sink->hasher);
+        } else if (sink->headers->rangeStart != sink->offset) {
+            fprintf(stderr, "Server sent bytes from %lld, not %lld\n", sink->headers->rangeStart, sink->offset);
+            return 0;
+        }
+    }
+    if (sink->written == 0) {
+        // a digest of compressed content doesn't tell us anything about the decompressed bytes
+        sink->verifying = sink->headers->digestAlgorithm != DIGEST_NONE
+            && sink->headers->status == 200 && !sink->headers->contentEncoded;
+        if (sink->verifying) digestStart(&sink->digest, sink->headers->digestAlgorithm);
+        // small files needn't touch the disk at all
+        if (sink->memoryAllowed && sink->offset == 0 && sink->headers->status == 200 && !sink->headers->contentEncoded) {
+            writeToMemory(sink, sink->headers->contentLength);
+        }
+    }
+    size_t length = size * nmemb;
+    if (fwrite(in, 1, length, sink->file) != length) {
+        fprintf(stderr, "Could not write download: %s\n", strerror(errno)); // e.g. the disk is full
+        return 0;
+    }
+    cacheHasherUpdate(&sink->hasher, in, length);
+    if (sink->verifying) digestUpdate(&sink->digest, in, length);
+    sink->written += length;
+    return length;
+}
+
+struct DownloadBatch;
+
+/* how many times to try a download that keeps failing with network errors */
+#define MAX_DOWNLOAD_ATTEMPTS 3
+
+/* why a download failed, if it ran out of time */
+static const char* timeoutError = "Download took longer than the timeout.";
+
+/* how long to wait for a connection to a server */
+#define CONNECT_TIMEOUT_SECONDS 15
+
+/* a transfer that gets less than LOW_SPEED_LIMIT bytes per second for LOW_SPEED_SECONDS has stalled,
+ * so it's abandoned (and tried again, resuming if possible) */
+#define LOW_SPEED_LIMIT 1024
+#define LOW_SPEED_SECONDS 20
+
+/*
+ * A transfer the user is waiting for that lags far behind what its server usually manages
+ * (e.g. because it got a bad connection, or an overloaded server behind a load balancer)
+ * is hedged - the same request goes out again, and whichever finishes first is used.
+ * Transfers aren't hedged until they've had HEDGE_MIN_DELAY_MS to get going, and then only if
+ * they've waited HEDGE_FIRST_BYTE_FACTOR times longer than usual for the content to start
+ * (or HEDGE_DEFAULT_FIRST_BYTE_MS for a server we don't know yet), or the content is arriving
+ * at less than 1/HEDGE_RATE_FACTOR of the usual rate, or it won't arrive before the deadline.
+ */
+#define HEDGE_MIN_DELAY_MS 1000
+#define HEDGE_FIRST_BYTE_FACTOR 3
+#define HEDGE_DEFAULT_FIRST_BYTE_MS 3000
+#define HEDGE_RATE_FACTOR 4
+
+/* transfers shorter than this don't tell us much about a server's rate */
+#define MIN_RATE_SAMPLE_BYTES 65536
+
+/* the current time in milliseconds, for measuring how long things take */
+static long long monotonicMilliseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* the biggest WAV header we'll fetch to find where the samples start */
+#define MAX_WAV_HEADER 1048576
+
+/* the stages of downloading a time window of a WAV file (e.g. "...wav#t=12.5,17.0") */
+typedef enum {
+    EXCERPT_NONE,       /* the whole file is wanted */
+    EXCERPT_HEADER,     /* getting the header, to find where the samples are */
+    EXCERPT_SAMPLES     /* getting just the samples in the time window */
+} ExcerptStage;
+
+/* the state of downloading a time window of a WAV file */
+typedef struct {
+    ExcerptStage stage;
+    double start;                       /* start of the time window, in seconds */
+    double end;                         /* end of the time window, or -1 for the end of the file */
+    unsigned char* header;              /* the start of the file */
+    size_t headerLength;                /* bytes of header received */
+    size_t headerWanted;                /* bytes of header asked for */
+    WavLayout layout;
+    long long first;                    /* offset of the first byte of samples wanted */
+    long long last;                     /* offset of the last byte of samples wanted */
+    char validator[256];                /* ETag or Last-Modified of the file the header came from */
+} Excerpt;
+
+/*
+ * A transfer in progress, which other requests for the same URL wait for instead of
+ * downloading it again.
+ */
+typedef struct InFlight {
+    char* normalizedUrl;
+    int done;                           /* whether the transfer has finished */
+    char* localfilename;                /* where it was saved, if it succeeded */
+    unsigned long long contentHash;     /* the hash of what was saved */
+    char error[1024];                   /* why it failed, if it didn't */
+    int waiters;                        /* how many other requests are waiting for it */
+    TransferPriority priority;          /* the priority of the most urgent request waiting for it */
+    struct InFlight* next;
+} InFlight;
+
+static InFlight* inFlight = NULL;
+static pthread_mutex_t inFlightLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inFlightDone = PTHREAD_COND_INITIALIZER;
+
+/* the state of one URL being downloaded */
+typedef struct Download {
+    char* url;
+    char* normalizedUrl;
+    InFlight* flight;                   /* the transfer this request is part of */
+    int owner;                          /* whether this request is doing the transfer, or waiting for it */
+    CURL* curl;
+    struct curl_slist* headerlist;
+    CacheEntry entry;
+    int cached;                         /* whether there was a usable copy in the cache */
+    char* directory;                    /* the cache entry's directory */
+    char tempfilename[CACHE_MAX_PATH];
+    ResponseHeaders headers;
+    DownloadSink sink;
+    curl_off_t now;                     /* bytes received so far */
+    curl_off_t total;                   /* bytes expected, or 0 if unknown */
+    int attempts;                       /* how many times the transfer has failed */
+    Excerpt excerpt;                    /* if only a time window of a WAV file is wanted */
+    char* localfilename;                /* full path of the local copy, once downloaded */
+    unsigned long long contentHash;     /* the hash of the local copy's content, once downloaded */
+    char* error;                        /* why it failed, if it did (freed with the download) */
+    int queued;                         /* whether it's waiting for a free slot on the server */
+    int slotHeld;                       /* whether it has one of the server's slots */
+    int paused;                         /* whether it's making way for more urgent transfers */
+    int diskOnly;                       /* whether the content has to be written to disk, even if it's small */
+    long long startedAt;                /* when the current transfer started (monotonicMilliseconds()) */
+    long long firstByteAt;              /* when its content started arriving, or 0 if it hasn't yet */
+    struct Download* hedge;             /* a second request for the same content, if this one is lagging */
+    struct Download* hedgeOf;           /* the request this is a hedge for, if it is one */
+    struct DownloadBatch* batch;
+} Download;
+
+/* a set of URLs being downloaded at the same time */
+typedef struct DownloadBatch {
+    Download* downloads;
+    int count;
+    int capacity;                       /* room for a hedge for each URL */
+    TransferPriority priority;
+    long long deadline;                 /* when the downloads must be finished by (monotonicMilliseconds()), or 0 */
+    ProgressTransfer* progress;         /* where the batch's progress is reported, or NULL */
+} DownloadBatch;
+
+/* sets the given download's error (replacing any it already had) to the given printf-style message */
+static void setDownloadError(Download* download, const char* format, ...) {
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(NULL, 0, format, arguments);
+    va_end(arguments);
+    free(download->error);
+    download->error = malloc(length + 1);
+    va_start(arguments, format);
+    vsnprintf(download->error, length + 1, format, arguments);
+    va_end(arguments);
+}
+
+/* forgets why the given download failed, because it's being tried again */
+static void clearDownloadError(Download* download) {
+    free(download->error);
+    download->error = NULL;
+}
+
+/* the priority of the given download's transfer, which is raised if a more urgent request joins it */
+static TransferPriority downloadPriority(Download* download) {
+    if (!download->flight) return download->batch->priority;
+    pthread_mutex_lock(&inFlightLock);
+    TransferPriority priority = download->flight->priority;
+    pthread_mutex_unlock(&inFlightLock);
+    return priority;
+}
+
+/* download progress callback - reports the progress of the whole batch */
 static int xferinfo(void *p,
                     curl_off_t dltotal, curl_off_t dlnow,
                     curl_off_t ultotal, curl_off_t ulnow)
 {
-    if (dltotal > 0) {
-        if (p) {
-            void (*downloadProgress)(long,long);
-            downloadProgress = p;
-            (*downloadProgress)(dlnow, dltotal);
+    Download* download = p;
+    // when resuming, curl only counts the rest of the file
+    curl_off_t resumedFrom = download->sink.offset;
+    download->now = dlnow + resumedFrom;
+    download->total = dltotal > 0 ? dltotal + resumedFrom : 0;
+    if (dlnow > 0 && !download->firstByteAt) download->firstByteAt = monotonicMilliseconds();
+    DownloadBatch* batch = download->batch;
+    if (batch->progress) {
+        curl_off_t batchNow = 0;
+        curl_off_t batchTotal = 0;
+        for (int d = 0; d < batch->count; d++) {
+            Download* counted = &batch->downloads[d];
+            if (counted->hedgeOf) continue;
+            // if it's been hedged, count whichever request is further ahead
+            if (counted->hedge && counted->hedge->now > counted->now) counted = counted->hedge;
+            batchNow += counted->now;
+            batchTotal += counted->total;
         }
-        //printf("progress: %ld%\n", ((100*dlnow) / dltotal));
+        if (batchTotal > 0) {
+            progressUpdate(batch->progress, batchNow, batchTotal);
+        }
+    }
+    // make way for transfers the user is waiting for
+    if (!download->paused && shouldYield(downloadPriority(download))) {
+        fprintf(stderr, "Pausing %s\n", download->url);
+        download->paused = 1;
+        curl_easy_pause(download->curl, CURLPAUSE_ALL);
     }
     return 0;
 }
 
+/* write callback for the header of a WAV file - keeps it in memory */
+static size_t write_excerpt_header(char *in, size_t size, size_t nmemb, void *userdata)
+{
+    Excerpt* excerpt = userdata;
+    size_t length = size * nmemb;
+    if (excerpt->headerLength + length > excerpt->headerWanted) {
+        // the server is sending more than we asked for (e.g. the whole file)
+        length = excerpt->headerWanted - excerpt->headerLength;
+        memcpy(excerpt->header + excerpt->headerLength, in, length);
+        excerpt->headerLength += length;
+        return 0; // that's all we need
+    }
+    memcpy(excerpt->header + excerpt->headerLength, in, length);
+    excerpt->headerLength += length;
+    return length;
+}
+
 /*
- * Converts all http:// and https:// URLs in the given script line to local file paths,
- * by downloading the content to a local file.
+ * Prepares a curl handle for downloading the given URL into the cache,
+ * asking the server to only send the content if it's changed since it was cached,
+ * or only the rest of the content if an earlier attempt was interrupted.
+ * Returns 0 on success, or sets download->error on failure.
  */
-char* downloadHttpToLocal(char* line, char* authorization, void (*downloadProgress)(long,long), char** error) {
-    // ensure we've initialized our URL/filename map
-    if (!urlToLocal) {
-        urlToLocal = hashmap_new();
+static int startDownload(Download* download, char* authorizationHeader) {
+    download->cached = cacheLookup(download->url, &download->entry);
+    free(download->directory);
+    download->directory = cacheEntryDirectory(download->url, &download->entry);
+    
+    // download to a temporary file in the entry's directory, so renaming it is cheap
+    snprintf(download->tempfilename, CACHE_MAX_PATH, "%s/%s", download->directory,
+             download->hedgeOf ? ".hedge" : ".download");
+    
+    // final name of the file - default to the last part of the URL path (but this might change)
+    char* url = download->url;
+    size_t pathLength = strcspn(url, "?#");
+    char* lastslash = url + pathLength;
+    while (lastslash > url && *(lastslash - 1) != '/') lastslash--;
+    size_t nameLength = url + pathLength - lastslash;
+    if (nameLength == 0 || nameLength >= sizeof(download->headers.fileName)) {
+        strcpy(download->headers.fileName, "download");
+    } else {
+        strncpy(download->headers.fileName, lastslash, nameLength);
+        download->headers.fileName[nameLength] = '\0';
     }
     
-    char* authorizationHeader = malloc(1024);
-    if (authorization) {
-        /* create authorization header */
-        sprintf(authorizationHeader, "Authorization: %s", authorization);
+    download->startedAt = monotonicMilliseconds();
+    download->firstByteAt = 0;
+    if (download->batch->deadline && download->startedAt >= download->batch->deadline) {
+        setDownloadError(download, "%s", timeoutError);
+        return -1;
+    }
+    
+    CURL* curl = acquireHandle();
+    if (!curl) {
+        fprintf(stderr, "curl_easy_init() failed\n");
+        setDownloadError(download, "Could not initialize curl.");
+        return -1;
+    }
+    download->curl = curl;
+    download->paused = 0;
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    /* tell libcurl to follow redirection */
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    
+    /* use HTTP/2 if the server offers it (over TLS), otherwise HTTP/1.1 - and rather than opening
+     * another connection while the first to the server is still being set up, wait to see if
+     * the request can be multiplexed on it - unless this is a hedge, which needs a different connection,
+     * or it's plain HTTP, which can't be multiplexed (and would otherwise wait for a connection that's busy) */
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    if (download->hedgeOf) {
+        curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+    } else if (strncasecmp(download->url, "https://", 8) == 0) {
+        curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    }
+    
+    /* don't wait forever for a server that isn't there, or a transfer that has stalled */
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)CONNECT_TIMEOUT_SECONDS);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)LOW_SPEED_LIMIT);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)LOW_SPEED_SECONDS);
+    if (download->batch->deadline) {
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)(download->batch->deadline - download->startedAt));
+    }
+    
+    /* open the file - if we have part of it already, we only need the rest */
+    CachePartial partial;
+    Excerpt* excerpt = &download->excerpt;
+    char range[64];
+    memset(&download->sink, 0, sizeof(DownloadSink));
+    download->sink.headers = &download->headers;
+    download->sink.tempfilename = download->tempfilename;
+    download->sink.memoryAllowed = !download->diskOnly;
+    if (excerpt->stage == EXCERPT_HEADER) {
+        /* first we only need the WAV header, to work out which bytes the time window covers */
+        excerpt->header = realloc(excerpt->header, excerpt->headerWanted);
+        excerpt->headerLength = 0;
+        snprintf(range, sizeof(range), "0-%ld", (long)excerpt->headerWanted - 1);
+        curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    } else if (excerpt->stage == EXCERPT_SAMPLES) {
+        /* then a WAV header for the excerpt, followed by the samples in the time window */
+        long long dataSize = excerpt->last - excerpt->first + 1;
+        size_t headerSize = 12 + excerpt->layout.fmtLength + 8;
+        if (!download->sink.memoryAllowed || !writeToMemory(&download->sink, headerSize + dataSize)) {
+            download->sink.file = fopen(download->tempfilename, "wb");
+        }
+        cacheHasherStart(&download->sink.hasher);
+        download->sink.rangeOnly = 1;
+        if (download->sink.file) {
+            unsigned char* wavHeader = malloc(headerSize);
+            if (wavMakeHeader(wavHeader, headerSize, excerpt->header, &excerpt->layout, dataSize) < 0
+                || fwrite(wavHeader, 1, headerSize, download->sink.file) != headerSize) {
+                fclose(download->sink.file);
+                download->sink.file = NULL;
+            } else { // include the header in the content hash
+                cacheHasherUpdate(&download->sink.hasher, wavHeader, headerSize);
+            }
+            free(wavHeader);
+        }
+        snprintf(range, sizeof(range), "%lld-%lld", excerpt->first, excerpt->last);
+        curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    } else if (cacheLoadPartial(download->tempfilename, &partial)) {
+        // the content hash has to cover what we've already got too
+        cacheHasherStart(&download->sink.hasher);
+        cacheHasherAddFile(&download->sink.hasher, download->tempfilename);
+        download->sink.file = fopen(download->tempfilename, "ab");
+        download->sink.offset = partial.size;
+    } else {
+        download->sink.file = fopen(download->tempfilename, "wb");
+        cacheHasherStart(&download->sink.hasher);
+    }
+    if (!download->sink.file && excerpt->stage != EXCERPT_HEADER) {
+        fprintf(stderr, "Could not open output file: %s\n", download->tempfilename);
+        setDownloadError(download, "Could not open output file.");
+        return -1;
     }
+    
+    if (authorizationHeader) {
+        /* add authorization header */
+        download->headerlist = curl_slist_append(download->headerlist, authorizationHeader);
+    }
+    if (excerpt->stage == EXCERPT_SAMPLES) {
+        /* the samples must come from the same version of the file as the header */
+        char validator[512];
+        snprintf(validator, sizeof(validator), "If-Range: %s", excerpt->validator);
+        download->headerlist = curl_slist_append(download->headerlist, validator);
+    } else if (download->sink.offset > 0) {
+        /* ask for the rest of the content, unless it has changed since we got the first part */
+        curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)download->sink.offset);
+        char validator[512];
+        snprintf(validator, sizeof(validator), "If-Range: %s",
+                 *partial.etag ? partial.etag : partial.lastModified);
+        download->headerlist = curl_slist_append(download->headerlist, validator);
+        fprintf(stderr, "Resuming %s from byte %lld\n", download->url, download->sink.offset);
+    } else if (download->cached) {
+        /* only download the content if it has changed since we cached it */
+        char validator[512];
+        if (*download->entry.etag) {
+            snprintf(validator, sizeof(validator), "If-None-Match: %s", download->entry.etag);
+            download->headerlist = curl_slist_append(download->headerlist, validator);
+        }
+        if (*download->entry.lastModified) {
+            snprintf(validator, sizeof(validator), "If-Modified-Since: %s", download->entry.lastModified);
+            download->headerlist = curl_slist_append(download->headerlist, validator);
+        }
+    }
+    if (download->headerlist) curl_easy_setopt(curl, CURLOPT_HTTPHEADER, download->headerlist);
+    if (excerpt->stage == EXCERPT_NONE && download->sink.offset == 0) {
+        /* TextGrids etc. compress well, so accept whatever encodings curl can decode as it streams in
+         * (byte ranges refer to the unencoded content, so they're left alone) */
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    }
+
+    /* callbacks and options */
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &download->headers);
+    if (excerpt->stage == EXCERPT_HEADER) {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_excerpt_header);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, excerpt);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_download);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &download->sink);
+    }
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, xferinfo);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, download);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    return 0;
+}
+
+/* finishes writing the content, returning 0 if it was all written
+ * - an in-memory file stays open (the stream has its own descriptor) until it's published or discarded */
+static int closeContent(DownloadSink* sink) {
+    int result = fclose(sink->file);
+    sink->file = NULL;
+    if (result != 0) fprintf(stderr, "Could not write download: %s\n", strerror(errno));
+    return result;
+}
+
+/* deletes the content downloaded so far */
+static void discardContent(Download* download) {
+    if (download->sink.inMemory) {
+        memoryFileDiscard(download->sink.memoryFile);
+        download->sink.inMemory = 0;
+    }
+    cacheDiscardPartial(download->tempfilename);
+}
+
+/*
+ * Keeps what has been downloaded so far, if the server gave us a way to check that
+ * the rest of the content will match it, so that a later attempt can resume from there.
+ */
+static void keepPartialDownload(Download* download) {
+    if (download->excerpt.stage != EXCERPT_NONE || download->sink.inMemory || download->hedgeOf) {
+        // small (or a duplicate), so just start again
+        discardContent(download);
+        return;
+    }
+    CachePartial partial;
+    strcpy(partial.etag, download->headers.etag);
+    strcpy(partial.lastModified, download->headers.lastModified);
+    partial.size = download->sink.offset + download->sink.written;
+    long status = download->headers.status;
+    if ((status == 200 || status == 206) && partial.size > 0 && (*partial.etag || *partial.lastModified)) {
+        if (cacheSavePartial(download->tempfilename, &partial) == 0) {
+            fprintf(stderr, "Kept %lld bytes of %s\n", partial.size, download->url);
+            return;
+        }
+    }
+    discardContent(download);
+}
+
+/* whether the download's content matches the digest the server sent, if it sent one */
+static int contentMatchesDigest(Download* download) {
+    if (!download->sink.verifying) return 1;
+    unsigned char digest[DIGEST_MAX_LENGTH];
+    digestFinish(&download->sink.digest, digest);
+    return memcmp(digest, download->headers.digest, digestLength(download->headers.digestAlgorithm)) == 0;
+}
 
-    char* local = malloc (strlen(line) * 2); // TODO is 2x the string length enough?
-    local[0] = '\0';
-    char* token;
-    const char delimiter[2] = " ";
+/* whether the given error is worth retrying */
+static int isTransient(CURLcode res) {
+    switch (res) {
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/* sets download->error to describe the given unexpected response code */
+static void responseCodeError(Download* download, long response_code) {
+    char* explanation = "";
+    switch (response_code) {
+        case 401: explanation = " (unauthorized)"; break;
+        case 403: explanation = " (forbidden)"; break;
+        case 404: explanation = " (not found)"; break;
+        case 408: explanation = " (request timeout)"; break;
+        case 416: explanation = " (range not satisfiable)"; break;
+        case 504: explanation = " (gateway timeout)"; break;
+    }
+    setDownloadError(download, "Response code: %ld%s", response_code, explanation);
+    fprintf (stderr, "ERROR: %s\n", download->error);
+}
+
+/*
+ * Deals with the header of a WAV file, working out which bytes of samples to download next.
+ * Returns 1 if there's another transfer to start, or 0 otherwise.
+ */
+static int finishExcerptHeader(Download* download, CURLcode res) {
+    Excerpt* excerpt = &download->excerpt;
+    long status = download->headers.status;
+    if (res != CURLE_OK && !(res == CURLE_WRITE_ERROR && excerpt->headerLength > 0)) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        setDownloadError(download, "%s", curl_easy_strerror(res));
+        return isTransient(res) && ++download->attempts < MAX_DOWNLOAD_ATTEMPTS;
+    }
+    if (status == 200) {
+        // the server doesn't support ranges, so we have to get the whole thing
+        fprintf(stderr, "Can't get part of %s, downloading the whole file\n", download->url);
+        excerpt->stage = EXCERPT_NONE;
+        return 1;
+    }
+    if (status != 206) {
+        responseCodeError(download, status);
+        return 0;
+    }
+    long long needed = wavParseHeader(excerpt->header, excerpt->headerLength, &excerpt->layout);
+    if (needed > 0 && excerpt->headerLength == excerpt->headerWanted && needed <= MAX_WAV_HEADER) {
+        // the header's longer than we thought - leave room for the chunks after this one too
+        excerpt->headerWanted = (size_t)needed + WAV_HEADER_GUESS;
+        return 1;
+    }
+    if (needed != 0) {
+        // not a WAV file (or not one we understand) so we have to get the whole thing
+        fprintf(stderr, "%s is not a WAV file, downloading the whole file\n", download->url);
+        excerpt->stage = EXCERPT_NONE;
+        return 1;
+    }
+    if (wavExcerptBytes(&excerpt->layout, excerpt->start, excerpt->end, &excerpt->first, &excerpt->last) != 0) {
+        setDownloadError(download, "Time range is outside the recording.");
+        fprintf (stderr, "ERROR: %s %s\n", download->error, download->url);
+        return 0;
+    }
+    snprintf(excerpt->validator, sizeof(excerpt->validator), "%s",
+             *download->headers.etag ? download->headers.etag : download->headers.lastModified);
+    if (!*excerpt->validator) {
+        // no way to be sure the samples would match the header, so get the whole thing
+        excerpt->stage = EXCERPT_NONE;
+        return 1;
+    }
+    fprintf(stderr, "Getting bytes %lld-%lld of %s\n", excerpt->first, excerpt->last, download->url);
+    excerpt->stage = EXCERPT_SAMPLES;
+    return 1;
+}
+
+/*
+ * Deals with the result of a finished transfer, moving the content into the cache
+ * and setting download->localfilename, or setting download->error on failure.
+ * Returns 1 if there's another transfer to start (e.g. the transfer failed but is worth trying again),
+ * or 0 otherwise.
+ */
+static int finishDownload(Download* download, CURLcode res) {
+    char* url = download->url;
+    CacheEntry* entry = &download->entry;
     
-    /* get the first token */
-    token = strtok(line, delimiter);
+    /* close the content file */
+    if (download->sink.file && closeContent(&download->sink) != 0 && res == CURLE_OK) {
+        res = CURLE_WRITE_ERROR; // e.g. the disk is full
+    }
+    
+    if (download->excerpt.stage == EXCERPT_HEADER
+        && !(res == CURLE_OK && download->headers.status == 304 && download->cached)) {
+        return finishExcerptHeader(download, res);
+    }
     
-    /* walk through other tokens */
-    while( token != NULL ) {
-        if (token != line) { // not the first token
-            strcat(local, " "); // add delimiter
+    /* Check for errors */
+    if(res != CURLE_OK) {
+        if (res == CURLE_WRITE_ERROR && download->sink.rangeOnly && download->headers.status == 200) {
+            // the file has changed since we got its header, so start again
+            discardContent(download);
+            download->excerpt.stage = EXCERPT_HEADER;
+            download->excerpt.headerWanted = WAV_HEADER_GUESS;
+            return ++download->attempts < MAX_DOWNLOAD_ATTEMPTS;
         }
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        setDownloadError(download, "%s", curl_easy_strerror(res));
+        if (isTransient(res)) {
+            // keep what we've got so far, so we don't have to download it again
+            keepPartialDownload(download);
+            return ++download->attempts < MAX_DOWNLOAD_ATTEMPTS;
+        }
+        discardContent(download); // delete the temporary file
+    } else {
+        // remember how quickly the server responded, to tell when later transfers are lagging
+        double firstByte = 0, total = 0;
+        curl_off_t received = 0;
+        long httpVersion = 0;
+        curl_easy_getinfo(download->curl, CURLINFO_STARTTRANSFER_TIME, &firstByte);
+        curl_easy_getinfo(download->curl, CURLINFO_TOTAL_TIME, &total);
+        curl_easy_getinfo(download->curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+        curl_easy_getinfo(download->curl, CURLINFO_HTTP_VERSION, &httpVersion);
+        recordHostTiming(url, firstByte, received >= MIN_RATE_SAMPLE_BYTES && total > firstByte
+                         ? received / (total - firstByte) : 0, httpVersion >= CURL_HTTP_VERSION_2_0);
         
-        // is the token a URL?
-        if (strstr(token, "http://") == token || strstr(token, "https://") == token) {
-            //fprintf (stderr, "Getting %s\n", token);
-            // download content to a local file
-            CURL* curl;
-            CURLcode res;
-            char* tempfilename = tmpnam(NULL);
-            FILE* urlfile;
-            // final name of the file - default to the last part of the URL path (but this might change)
-            char* localfilename = malloc(256);
-            // put the final file in the same directory as the temp file
-            strcpy(localfilename, tempfilename);
-            char* lastslashintempfilename = strrchr(localfilename, '/');
-            strcpy(lastslashintempfilename + 1, strrchr(token, '/') + 1);
-            // ignore the query string, if any
-            char* querystringstart = strchr(localfilename, '?');
-            if (querystringstart) *querystringstart = '\0';
-
-            curl = curl_easy_init();
-            if(curl) {
-                curl_easy_setopt(curl, CURLOPT_URL, token);
-                /* tell libcurl to follow redirection */
-                curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        long response_code;
+        curl_easy_getinfo(download->curl, CURLINFO_RESPONSE_CODE, &response_code);
+        if (response_code == 206) response_code = 200; // the rest of a partial download
+        if (response_code == 304 && download->cached) {
+            // our copy is still current
+            discardContent(download);
+            download->localfilename = strdup(entry->path);
+            download->contentHash = entry->contentHash;
+            fprintf(stderr, "%s not modified\n", url);
+        } else if (response_code == 416 && download->sink.offset > 0) {
+            // the partial download doesn't fit the content any more, so start again
+            discardContent(download);
+            return ++download->attempts < MAX_DOWNLOAD_ATTEMPTS;
+        } else if (response_code != 200) {
+            responseCodeError(download, response_code);
+            discardContent(download); // delete the temporary file
+        } else if (!contentMatchesDigest(download)) {
+            fprintf(stderr, "Content of %s doesn't match the server's digest\n", url);
+            discardContent(download); // it was probably corrupted on the way, so start again
+            if (++download->attempts < MAX_DOWNLOAD_ATTEMPTS) return 1;
+            setDownloadError(download, "Downloaded content doesn't match the server's digest.");
+        } else {
+            // rename content file to something sensible
+            char* fileName = download->headers.fileName;
+            char* lastslashinname = strrchr(fileName, '/');
+            if (lastslashinname) fileName = lastslashinname + 1;
+            char name[CACHE_MAX_PATH];
+            if (download->excerpt.stage == EXCERPT_SAMPLES) {
+                // name the excerpt after the time window, e.g. utterance_12.5-17.wav
+                char window[64];
+                if (download->excerpt.end < 0) {
+                    snprintf(window, sizeof(window), "_%g-", download->excerpt.start);
+                } else {
+                    snprintf(window, sizeof(window), "_%g-%g", download->excerpt.start, download->excerpt.end);
+                }
+                char* extension = strrchr(fileName, '.');
+                int baseLength = extension ? (int)(extension - fileName) : (int)strlen(fileName);
+                snprintf(name, sizeof(name), "%.*s%s%s",
+                         baseLength, fileName, window, extension ? extension : ".wav");
+            } else {
+                snprintf(name, sizeof(name), "%s", fileName);
+            }
+            char* localfilename = malloc(CACHE_MAX_PATH);
+            if (snprintf(localfilename, CACHE_MAX_PATH, "%s/%s", download->directory, name) >= CACHE_MAX_PATH) {
+                fprintf(stderr, "Local file name for %s is too long\n", url);
+                setDownloadError(download, "Local file name too long.");
+                discardContent(download); // delete the temporary file
+                free(localfilename);
+            } else if (download->sink.inMemory) {
+                // hand it over without touching the disk (it's not worth caching)
+                free(localfilename);
+                download->sink.inMemory = 0;
+                download->localfilename = memoryFilePublish(download->sink.memoryFile, name);
+                download->contentHash = cacheHasherFinish(&download->sink.hasher);
+                if (!download->localfilename) {
+                    download->diskOnly = 1; // so get it again, the usual way
+                    return 1;
+                }
+            } else if (rename(download->tempfilename, localfilename) != 0) {
+                setDownloadError(download, "Could not rename %s to %s", download->tempfilename, localfilename);
+                fprintf(stderr, "%s\n", download->error);
+                cacheDiscardPartial(download->tempfilename); // delete the temporary file
+                free(localfilename);
+            } else {
+                cacheDiscardPartial(download->tempfilename); // forget it was ever partial
+                // get canonical path of local file
+                char *full_path = realpath(localfilename, NULL);
+                if (full_path) {
+                    // if it doesn't fit, the name it was renamed to will do
+                    if (strlen(full_path) < CACHE_MAX_PATH) strcpy(localfilename, full_path);
+                    free(full_path);
+                }
                 
-                /* open the file */
-                urlfile = fopen(tempfilename, "wb");
-                if(urlfile) {
-                    struct curl_slist *headerlist = NULL;
-                    if (authorization) {
-                        /* add authorization header */
-                        headerlist = curl_slist_append(headerlist, authorizationHeader);
-                        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
-                    }
-                    
-                    /* callbacks and options */
-                    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
-                    curl_easy_setopt(curl, CURLOPT_HEADERDATA, lastslashintempfilename + 1);
-                    curl_easy_setopt(curl, CURLOPT_WRITEDATA, urlfile);
-                    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, xferinfo);
-                    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, downloadProgress);
-                    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-                    
-                    /* Perform the request, res will get the return code */
-                    res = curl_easy_perform(curl);
-                    
-                    /* close the content file */
-                    fclose(urlfile);
-                    
-                    /* Check for errors */
-                    if(res != CURLE_OK) {
-                        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-                        *error = curl_easy_strerror(res);
-                        remove(tempfilename); // delete the temporary file
-                    } else {
-                        long response_code;
-                        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-                        if (response_code != 200) {
-                            char* explanation = "";
-                            switch (response_code) {
-                                case 401: explanation = " (unauthorized)"; break;
-                                case 403: explanation = " (forbidden)"; break;
-                                case 404: explanation = " (not found)"; break;
-                                case 408: explanation = " (request timeout)"; break;
-                                case 504: explanation = " (gateway timeout)"; break;
+                // if the file's name has changed, the old version is no longer needed
+                if (*entry->path && strcmp(entry->path, localfilename) != 0) remove(entry->path);
+                
+                // remember the validators for next time
+                snprintf(entry->path, CACHE_MAX_PATH, "%s", localfilename);
+                strcpy(entry->etag, download->headers.etag);
+                strcpy(entry->lastModified, download->headers.lastModified);
+                entry->contentHash = cacheHasherFinish(&download->sink.hasher);
+                if (cacheStore(entry) != 0) {
+                    fprintf(stderr, "Could not cache %s\n", url);
+                }
+                download->localfilename = localfilename;
+                download->contentHash = entry->contentHash;
+            }
+        } // response code ok
+    } // request ok
+    return 0;
+}
+
+/* whether the given character marks the end of a URL in a script line */
+static int endsUrl(char c) {
+    return c == '\0' || isspace((unsigned char)c) || c == '"' || c == '\'';
+}
+
+/*
+ * Finds the first http:// or https:// URL between the given start and end of a script line - on its own,
+ * or inside quotes - and sets *length to its length. Returns NULL if there isn't one.
+ */
+static const char* findUrl(const char* start, const char* end, size_t* length) {
+    // memchr is vectorized, so it's much quicker to jump from one 'h' to the next than to try every character
+    for (const char* h = memchr(start, 'h', end - start); h; h = memchr(h + 1, 'h', end - h - 1)) {
+        size_t schemeLength = 0;
+        if (end - h > 7 && strncmp(h, "http://", 7) == 0) schemeLength = 7;
+        else if (end - h > 8 && strncmp(h, "https://", 8) == 0) schemeLength = 8;
+        if (!schemeLength) continue;
+        if (h > start && isalnum((unsigned char)h[-1])) continue; // part of some other word
+        const char* last = h + schemeLength;
+        while (last < end && !endsUrl(*last)) last++;
+        *length = last - h;
+        return h;
+    }
+    return NULL;
+}
+
+/* calls the given function for each http:// or https:// URL in the given script line */
+static void forEachUrl(const char* line, void (*f)(char*, void*), void* data) {
+    size_t lineLength = strlen(line);
+    char* copy = strdup(line);
+    size_t length = 0;
+    for (const char* url = findUrl(line, line + lineLength, &length); url;
+         url = findUrl(url + length, line + lineLength, &length)) {
+        // the copy has the URL terminated where it ends
+        char* urlCopy = copy + (url - line);
+        urlCopy[length] = '\0';
+        f(urlCopy, data);
+    }
+    free(copy);
+}
+
+/* forEachUrl() function that counts URLs */
+static void countUrl(char* url, void* count) {
+    (*(int*)count)++;
+}
+
+/* returns whether the given URL was downloaded so recently that there's no need to check it again */
+static int isFresh(char* url) {
+    int fresh = 0;
+    LocalFile* local = NULL;
+    pthread_mutex_lock(&urlToLocalLock);
+    if (urlToLocal && hashmap_get(urlToLocal, url, (void**)(&local)) == MAP_OK
+        && time(NULL) - local->validated < FRESHNESS_SECONDS) {
+        struct stat status;
+        fresh = stat(local->path, &status) == 0;
+    }
+    pthread_mutex_unlock(&urlToLocalLock);
+    return fresh;
+}
+
+/* forEachUrl() function that adds the URL to the batch, unless it's already there */
+static void addUrlToBatch(char* url, void* data) {
+    DownloadBatch* batch = data;
+    for (int d = 0; d < batch->count; d++) {
+        if (strcmp(batch->downloads[d].url, url) == 0) return;
+    }
+    if (isFresh(url)) return; // e.g. prefetched
+    Download* download = &batch->downloads[batch->count++];
+    memset(download, 0, sizeof(Download));
+    download->url = strdup(url);
+    download->normalizedUrl = cacheNormalizeUrl(url);
+    download->batch = batch;
+    if (wavParseTimeFragment(url, &download->excerpt.start, &download->excerpt.end)) {
+        // only a time window of the recording is wanted
+        download->excerpt.stage = EXCERPT_HEADER;
+        download->excerpt.headerWanted = WAV_HEADER_GUESS;
+    }
+}
+
+/*
+ * Joins the transfer of the given download's URL that's already in progress, if there is one,
+ * or otherwise registers the download as a transfer others can join.
+ */
+static void joinOrStartFlight(Download* download) {
+    pthread_mutex_lock(&inFlightLock);
+    InFlight* flight = inFlight;
+    while (flight && strcmp(flight->normalizedUrl, download->normalizedUrl) != 0) flight = flight->next;
+    if (flight) {
+        flight->waiters++;
+        download->owner = 0;
+        // if we're more urgent, so is the transfer
+        if (download->batch->priority < flight->priority) flight->priority = download->batch->priority;
+    } else {
+        flight = calloc(1, sizeof(InFlight));
+        flight->normalizedUrl = strdup(download->normalizedUrl);
+        flight->priority = download->batch->priority;
+        flight->next = inFlight;
+        inFlight = flight;
+        download->owner = 1;
+    }
+    download->flight = flight;
+    pthread_mutex_unlock(&inFlightLock);
+}
+
+/* frees the given transfer, which has finished and has nobody waiting for it - must hold inFlightLock */
+static void freeFlight(InFlight* flight) {
+    free(flight->normalizedUrl);
+    free(flight->localfilename);
+    free(flight);
+}
+
+/* tells anyone waiting for the given download's transfer how it went */
+static void finishFlight(Download* download) {
+    InFlight* flight = download->flight;
+    pthread_mutex_lock(&inFlightLock);
+    // later requests will start a new transfer
+    InFlight** link = &inFlight;
+    while (*link && *link != flight) link = &(*link)->next;
+    if (*link) *link = flight->next;
+    if (download->localfilename) flight->localfilename = strdup(download->localfilename);
+    flight->contentHash = download->contentHash;
+    if (download->error) snprintf(flight->error, sizeof(flight->error), "%s", download->error);
+    flight->done = 1;
+    if (flight->waiters == 0) {
+        freeFlight(flight);
+    } else {
+        pthread_cond_broadcast(&inFlightDone);
+    }
+    pthread_mutex_unlock(&inFlightLock);
+    download->flight = NULL;
+}
+
+/* finishes the given download's transfer as soon as its result is known - when it or its hedge has
+ * succeeded, or neither is still going - so requests waiting for it don't wait for the rest of the batch */
+static void finishFlightIfSettled(Download* download) {
+    Download* original = download->hedgeOf ? download->hedgeOf : download;
+    if (!original->owner || !original->flight) return;
+    if (!original->localfilename && (original->curl || (original->hedge && original->hedge->curl))) return;
+    finishFlight(original);
+}
+
+/* waits for the transfer another request is doing for the given download's URL, and takes its result */
+static void waitForFlight(Download* download) {
+    InFlight* flight = download->flight;
+    long long deadline = download->batch->deadline;
+    pthread_mutex_lock(&inFlightLock);
+    while (!flight->done) {
+        if (!deadline) {
+            pthread_cond_wait(&inFlightDone, &inFlightLock);
+        } else {
+            long long remaining = deadline - monotonicMilliseconds();
+            if (remaining <= 0) break;
+            struct timespec until;
+            timeAfter(remaining, &until);
+            pthread_cond_timedwait(&inFlightDone, &inFlightLock, &until);
+        }
+    }
+    if (!flight->done) { // it'll carry on without us
+        setDownloadError(download, "%s", timeoutError);
+    } else if (flight->localfilename) {
+        download->localfilename = strdup(flight->localfilename);
+        download->contentHash = flight->contentHash;
+    } else {
+        setDownloadError(download, "%s", *flight->error ? flight->error : "Download failed.");
+    }
+    if (--flight->waiters == 0 && flight->done) freeFlight(flight);
+    pthread_mutex_unlock(&inFlightLock);
+    download->flight = NULL;
+}
+
+/* starts the batch's downloads that are waiting for a free slot on their server, if there is one now,
+ * adding them to *running - returns how many are no longer waiting */
+static int startQueuedDownloads(DownloadBatch* batch, CURLM* multi, char* authorizationHeader, int* running) {
+    int started = 0;
+    for (int d = 0; d < batch->count; d++) {
+        Download* download = &batch->downloads[d];
+        if (!download->queued || !acquireHostSlot(download->url, downloadPriority(download))) continue;
+        download->queued = 0;
+        started++;
+        //fprintf (stderr, "Getting %s\n", download->url);
+        if (startDownload(download, authorizationHeader) == 0) {
+            download->slotHeld = 1;
+            curl_multi_add_handle(multi, download->curl);
+            (*running)++;
+        } else {
+            releaseHostSlot(download->url);
+            finishFlightIfSettled(download);
+        }
+    }
+    return started;
+}
+
+/* resumes the batch's paused downloads, if they no longer have to make way for others
+ * - returns whether any are still paused */
+static int resumeDownloads(DownloadBatch* batch) {
+    int paused = 0;
+    for (int d = 0; d < batch->count; d++) {
+        Download* download = &batch->downloads[d];
+        if (!download->paused) continue;
+        if (shouldYield(downloadPriority(download))) {
+            paused = 1;
+        } else {
+            download->paused = 0;
+            curl_easy_pause(download->curl, CURLPAUSE_CONT);
+        }
+    }
+    return paused;
+}
+
+/* whether the given transfer is so far behind what its server usually manages that it's worth
+ * asking again, or it won't finish before the deadline at the rate it's going */
+static int isLagging(Download* download, long long now) {
+    long long elapsed = now - download->startedAt;
+    if (elapsed < HEDGE_MIN_DELAY_MS) return 0;
+    double firstByteSeconds, bytesPerSecond;
+    hostTiming(download->url, &firstByteSeconds, &bytesPerSecond);
+    if (!download->firstByteAt) { // still waiting for the content to start
+        double expected = firstByteSeconds > 0
+            ? firstByteSeconds * 1000 * HEDGE_FIRST_BYTE_FACTOR : HEDGE_DEFAULT_FIRST_BYTE_MS;
+        return elapsed > expected;
+    }
+    long long receiving = now - download->firstByteAt;
+    if (receiving < HEDGE_MIN_DELAY_MS) return 0;
+    double rate = (double)(download->now - download->sink.offset) * 1000 / receiving;
+    if (rate * HEDGE_RATE_FACTOR < bytesPerSecond) return 1;
+    if (download->batch->deadline && download->total > download->now) {
+        if (rate <= 0) return 1;
+        return now + (download->total - download->now) * 1000 / rate > download->batch->deadline;
+    }
+    return 0;
+}
+
+/* sends a second request for each of the batch's transfers that are lagging,
+ * if their servers have room for it, adding them to *running */
+static void startHedges(DownloadBatch* batch, CURLM* multi, char* authorizationHeader, int* running) {
+    long long now = monotonicMilliseconds();
+    int count = batch->count; // not the hedges we're about to add
+    for (int d = 0; d < count && batch->count < batch->capacity; d++) {
+        Download* download = &batch->downloads[d];
+        if (!download->curl || download->hedge || download->hedgeOf
+            || download->excerpt.stage == EXCERPT_HEADER || !isLagging(download, now)) continue;
+        if (!acquireHostSlot(download->url, TRANSFER_INTERACTIVE)) continue;
+        fprintf(stderr, "Hedging %s\n", download->url);
+        Download* hedge = &batch->downloads[batch->count++];
+        memset(hedge, 0, sizeof(Download));
+        hedge->url = download->url;
+        hedge->normalizedUrl = download->normalizedUrl;
+        hedge->batch = batch;
+        hedge->hedgeOf = download;
+        hedge->diskOnly = download->diskOnly;
+        hedge->attempts = MAX_DOWNLOAD_ATTEMPTS - 1; // a hedge only gets one try
+        hedge->excerpt = download->excerpt;
+        if (download->excerpt.header) {
+            hedge->excerpt.header = malloc(download->excerpt.headerWanted);
+            memcpy(hedge->excerpt.header, download->excerpt.header, download->excerpt.headerLength);
+        }
+        download->hedge = hedge;
+        if (startDownload(hedge, authorizationHeader) == 0) {
+            hedge->slotHeld = 1;
+            curl_multi_add_handle(multi, hedge->curl);
+            (*running)++;
+            pthread_mutex_lock(&statisticsLock);
+            statistics.hedges++;
+            pthread_mutex_unlock(&statisticsLock);
+        } else {
+            releaseHostSlot(download->url);
+        }
+    }
+}
+
+/* stops the given download's transfer, and throws away whatever it has received */
+static void cancelDownload(Download* download, CURLM* multi) {
+    if (!download->curl) return;
+    curl_multi_remove_handle(multi, download->curl);
+    releaseHandle(download->curl);
+    download->curl = NULL;
+    if (download->sink.file) closeContent(&download->sink);
+    discardContent(download);
+    if (download->slotHeld) {
+        releaseHostSlot(download->url);
+        download->slotHeld = 0;
+    }
+}
+
+/* when a hedged download or its hedge has finished, decides whose result to use
+ * - whichever succeeds first wins, but if one fails, the other may still succeed */
+static void settleHedge(Download* download, CURLM* multi) {
+    Download* original = download->hedgeOf ? download->hedgeOf : download;
+    Download* hedge = original->hedge;
+    if (hedge && download->localfilename) {
+        cancelDownload(download == original ? hedge : original, multi);
+        if (download == hedge) {
+            fprintf(stderr, "Hedge for %s finished first\n", original->url);
+            free(original->localfilename);
+            original->localfilename = hedge->localfilename;
+            original->contentHash = hedge->contentHash;
+            clearDownloadError(original);
+            hedge->localfilename = NULL;
+            pthread_mutex_lock(&statisticsLock);
+            statistics.hedgesWon++;
+            pthread_mutex_unlock(&statisticsLock);
+        }
+    }
+}
+
+/* hashmap_iterate() callback that stops (returning MAP_MISSING) at a URL saved with the given path */
+static int lacksPath(any_t path, any_t data) {
+    LocalFile* local = data;
+    return strcmp(local->path, path) == 0 ? MAP_MISSING : MAP_OK;
+}
+
+/*
+ * Downloads all http:// and https:// URLs in the given script lines at the same time.
+ * URLs that are already being downloaded (e.g. by a prefetch) aren't downloaded again;
+ * instead, we wait for the transfer that's in progress.
+ * Interactive downloads pause other transfers until they're finished.
+ */
+int downloadAllHttpToLocal(char** lines, int lineCount, TransferPriority priority, long timeout, char* authorization, ProgressTransfer* progress, char** error) {
+    // find all the URLs first
+    int urlCount = 0;
+    for (int l = 0; l < lineCount; l++) forEachUrl(lines[l], countUrl, &urlCount);
+    if (urlCount == 0) return DOWNLOAD_OK;
+    DownloadBatch batch;
+    // only transfers the user is waiting for are hedged
+    batch.capacity = priority == TRANSFER_INTERACTIVE ? urlCount * 2 : urlCount;
+    batch.downloads = calloc(batch.capacity, sizeof(Download));
+    batch.count = 0;
+    batch.priority = priority;
+    batch.deadline = timeout > 0 ? monotonicMilliseconds() + timeout : 0;
+    batch.progress = progress;
+    for (int l = 0; l < lineCount; l++) forEachUrl(lines[l], addUrlToBatch, &batch);
+    
+    char* authorizationHeader = NULL;
+    if (authorization) {
+        /* create authorization header */
+        authorizationHeader = malloc(strlen(authorization) + 16);
+        sprintf(authorizationHeader, "Authorization: %s", authorization);
+    }
+    
+    // start as many transfers at once as the servers allow
+    CURLM* multi = threadMulti();
+    int running = 0;
+    int queued = 0;
+    for (int d = 0; d < batch.count; d++) {
+        Download* download = &batch.downloads[d];
+        joinOrStartFlight(download);
+        if (!download->owner) {
+            fprintf (stderr, "Already getting %s\n", download->url);
+            continue;
+        }
+        download->queued = 1;
+        queued++;
+    }
+    // other transfers only make way while we're transferring something ourselves -
+    // not while we wait for theirs, which would stop the batches we're waiting for from finishing
+    int interactive = priority == TRANSFER_INTERACTIVE && queued > 0;
+    if (interactive) setInteractive(1);
+    
+    // and wait until they've all finished
+    while (running > 0 || queued > 0) {
+        if (transfersStopped) break; // what's been downloaded so far is kept for next time
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "curl_multi failed: %s\n", curl_multi_strerror(mc));
+            break;
+        }
+        CURLMsg* message;
+        int messagesLeft;
+        while ((message = curl_multi_info_read(multi, &messagesLeft))) {
+            if (message->msg == CURLMSG_DONE) {
+                for (int d = 0; d < batch.count; d++) {
+                    Download* download = &batch.downloads[d];
+                    if (download->curl == message->easy_handle) {
+                        int again = finishDownload(download, message->data.result);
+                        curl_multi_remove_handle(multi, download->curl);
+                        releaseHandle(download->curl);
+                        download->curl = NULL;
+                        if (again) {
+                            // try again, picking up where we left off
+                            curl_slist_free_all(download->headerlist);
+                            download->headerlist = NULL;
+                            clearDownloadError(download);
+                            if (startDownload(download, authorizationHeader) == 0) {
+                                curl_multi_add_handle(multi, download->curl);
+                                running++;
                             }
-                            sprintf(statusErrorBuffer, "Response code: %ld%s", response_code, explanation);
-                            *error = statusErrorBuffer;
-                            fprintf (stderr, "ERROR: %s\n", *error);
-                            remove(tempfilename); // delete the temporary file
                         } else {
-                            // rename content file to something sensible
-                            //fprintf(stderr, "%s -> %s\n", tempfilename, localfilename);
-                            if (rename(tempfilename, localfilename) != 0) {
-                                sprintf(statusErrorBuffer, "Could not rename %s to %s\n", tempfilename, localfilename);
-                                fprintf(stderr, statusErrorBuffer);
-                                *error = statusErrorBuffer;
-                                remove(tempfilename); // delete the temporary file
-                            } else {
-                                // get canonical path of local file
-                                char *full_path = realpath(localfilename, NULL);
-                                strcpy(localfilename, full_path);
-                                free(full_path);
-
-                                // remember while file the URL was saved as
-                                hashmap_put(urlToLocal, token, localfilename);
-                                fprintf(stderr, "%s -> %s\n", token, localfilename);
-
-                                // reference that in the line
-                                token = localfilename;
-                            }
-                        } // response code ok
-                    } // request ok
-                } else {
-                    fprintf(stderr, "Could not open output file: %s\n", tempfilename);
-                    *error = "Could not open output file.";
+                            // let the next transfer to the server start
+                            releaseHostSlot(download->url);
+                            download->slotHeld = 0;
+                            settleHedge(download, multi);
+                        }
+                        finishFlightIfSettled(download);
+                        break;
+                    }
                 }
-                /* always cleanup */
-                curl_easy_cleanup(curl);
-            } else { // curl_easy_init failed
-                fprintf(stderr, "curl_easy_init() failed\n");
-                *error = "Could not initialize curl.";
             }
-        } // is URL
-        // add the token to the local version of the line
-        strcat(local, token);
-        
-        // next token
-        token = strtok(NULL, delimiter);
-    } // next token
+        } // next message
+        if (queued > 0) {
+            int started = startQueuedDownloads(&batch, multi, authorizationHeader, &running);
+            queued -= started;
+            if (started > 0) continue; // get them going straight away
+            if (running == 0) {
+                // all the servers' slots are taken by other requests
+                waitForScheduler(100);
+                continue;
+            }
+        }
+        if (priority == TRANSFER_INTERACTIVE) startHedges(&batch, multi, authorizationHeader, &running);
+        if (running > 0) {
+            // check paused transfers often, so they resume promptly, and lagging ones so they're hedged promptly
+            int interval = resumeDownloads(&batch) ? 100 : priority == TRANSFER_INTERACTIVE ? 250 : 1000;
+            mc = curl_multi_wait(multi, NULL, 0, interval, NULL);
+            if (mc != CURLM_OK) {
+                fprintf(stderr, "curl_multi failed: %s\n", curl_multi_strerror(mc));
+                break;
+            }
+        }
+    } // still running
     
+    for (int d = 0; d < batch.count; d++) {
+        Download* download = &batch.downloads[d];
+        if (download->curl) {
+            curl_multi_remove_handle(multi, download->curl);
+            /* always cleanup */
+            releaseHandle(download->curl);
+        }
+        if (download->sink.file) { // never finished
+            closeContent(&download->sink);
+            keepPartialDownload(download);
+            if (!download->error) setDownloadError(download, "Download interrupted.");
+        } else if (download->queued && !download->error) { // stopped before it could start
+            setDownloadError(download, "Download not started.");
+        }
+        if (download->slotHeld) releaseHostSlot(download->url);
+        curl_slist_free_all(download->headerlist);
+        free(download->excerpt.header);
+        if (download->owner && download->flight) finishFlight(download);
+    } // next download
+    if (interactive) setInteractive(0);
+    
+    // collect the results of transfers other requests were doing for us
+    int failed = 0;
+    for (int d = 0; d < batch.count; d++) {
+        Download* download = &batch.downloads[d];
+        if (download->hedgeOf) { // its result went to the download it was hedging
+            free(download->directory);
+            free(download->error);
+            continue;
+        }
+        if (download->flight) waitForFlight(download);
+        if (download->localfilename) {
+            fprintf(stderr, "%s -> %s\n", download->url, download->localfilename);
+            // remember which file the URL was saved as
+            LocalFile* local = NULL;
+            pthread_mutex_lock(&urlToLocalLock);
+            if (!urlToLocal) urlToLocal = hashmap_new();
+            if (hashmap_get(urlToLocal, download->url, (void**)(&local)) == MAP_OK) {
+                char* replaced = local->path;
+                local->path = download->localfilename;
+                // an in-memory copy it replaces would otherwise be kept until the process exits
+                if (strcmp(replaced, local->path) != 0 && hashmap_iterate(urlToLocal, lacksPath, replaced) == MAP_OK) {
+                    memoryFileRelease(replaced);
+                }
+                free(replaced);
+                free(download->url);
+            } else {
+                local = malloc(sizeof(LocalFile));
+                local->url = download->url;
+                hashmap_put(urlToLocal, local->url, local);
+            }
+            local->path = download->localfilename;
+            local->validated = time(NULL);
+            local->contentHash = download->contentHash;
+            pthread_mutex_unlock(&urlToLocalLock);
+        } else {
+            if (download->error && !*error) *error = strdup(download->error);
+            failed = 1;
+            free(download->url);
+        }
+        free(download->normalizedUrl);
+        free(download->directory);
+        free(download->error);
+    } // next download
+    free(batch.downloads);
     free(authorizationHeader);
-    return local;
+    if (failed && batch.deadline && monotonicMilliseconds() >= batch.deadline) {
+        free(*error);
+        *error = strdup(timeoutError);
+        return DOWNLOAD_TIMED_OUT;
+    }
+    return failed ? DOWNLOAD_FAILED : DOWNLOAD_OK;
+}
+
+/*
+ * Converts all http:// and https:// URLs in the given script line to local file paths,
+ * by downloading the content to a local file.
+ */
+char* downloadHttpToLocal(char* line, char* authorization, ProgressTransfer* progress, char** error) {
+    downloadAllHttpToLocal(&line, 1, TRANSFER_INTERACTIVE, 0, authorization, progress, error);
+    return rewriteHttpToLocal(line);
+}
+
+/* the local file that a URL in a script line will be replaced with */
+typedef struct {
+    size_t offset;              /* where the URL starts in the line */
+    size_t length;              /* how long the URL is */
+    char* path;                 /* the path to put in its place */
+} UrlReplacement;
+
+/* returns the path of the local copy of the given URL, which the caller must free, or NULL if there isn't one */
+static char* localPath(const char* url) {
+    char* path = NULL;
+    LocalFile* localfile;
+    pthread_mutex_lock(&urlToLocalLock);
+    if (urlToLocal && hashmap_get(urlToLocal, (char*)url, (void**)(&localfile)) == MAP_OK) {
+        path = strdup(localfile->path);
+    }
+    pthread_mutex_unlock(&urlToLocalLock);
+    if (!path) { // not downloaded by this process, but maybe by an earlier one
+        CacheEntry entry;
+        cacheLookup(url, &entry);
+        if (*entry.path) path = strdup(entry.path);
+    }
+    return path;
 }
 
 /*
@@ -195,156 +1606,502 @@ char* downloadHttpToLocal(char* line, char* authorization, void (*downloadProgre
  * if they have already been downloaded using convertHttpToLocal() to local file paths,
  * rewrites them as local file names.
  */
-char* rewriteHttpToLocal(char* line) {
-    char* local = malloc (strlen(line) * 2); // TODO is 2x the string length enough?
-    local[0] = '\0';
-    char* token;
-    const char delimiter[2] = " ";
-    
-    /* get the first token */
-    token = strtok(line, delimiter);
-    
-    /* walk through other tokens */
-    while( token != NULL ) {
-        if (token != line) { // not the first token
-            strcat(local, " "); // add delimiter
+char* rewriteHttpToLocal(const char* line) {
+    size_t lineLength = strlen(line);
+    size_t localLength = lineLength;
+    // find the URLs and what they'll be replaced with
+    UrlReplacement someReplacements[8];
+    UrlReplacement* replacements = someReplacements;
+    int capacity = sizeof(someReplacements) / sizeof(UrlReplacement);
+    int count = 0;
+    char* copy = NULL;
+    size_t length = 0;
+    for (const char* url = findUrl(line, line + lineLength, &length); url;
+         url = findUrl(url + length, line + lineLength, &length)) {
+        if (!copy) copy = strdup(line);
+        char* urlCopy = copy + (url - line);
+        urlCopy[length] = '\0';
+        char* path = localPath(urlCopy);
+        if (!path) continue; // leave it as it is
+        if (count == capacity) {
+            capacity *= 2;
+            if (replacements == someReplacements) {
+                replacements = malloc(capacity * sizeof(UrlReplacement));
+                memcpy(replacements, someReplacements, sizeof(someReplacements));
+            } else {
+                replacements = realloc(replacements, capacity * sizeof(UrlReplacement));
+            }
         }
-        
-        // is the token a URL?
-        if (strstr(token, "http://") == token || strstr(token, "https://") == token) {
-            // file the local file
-            if (urlToLocal) {
-                char* localfilename;
-                int error = hashmap_get(urlToLocal, token, (void**)(&localfilename));
-                if (error == MAP_OK) {
-                    //fprintf(stderr, "found %s -> %s\n", token, localfilename);
-                    // reference that in the line
-                    token = localfilename;
-                } // found local filename
-            } // map has been initialised
-        } // is URL
-        
-        // add the token to the local version of the line
-        strcat(local, token);
-        
-        // next token
-        token = strtok(NULL, delimiter);
-    } // next token
+        replacements[count].offset = url - line;
+        replacements[count].length = length;
+        replacements[count].path = path;
+        localLength += strlen(path) - length;
+        count++;
+    } // next URL
+    free(copy);
     
+    // build the local version of the line, with the URLs replaced
+    char* local = malloc(localLength + 1);
+    char* end = local;
+    size_t copied = 0; // how much of the line has been dealt with
+    for (int r = 0; r < count; r++) {
+        memcpy(end, line + copied, replacements[r].offset - copied);
+        end += replacements[r].offset - copied;
+        size_t pathLength = strlen(replacements[r].path);
+        memcpy(end, replacements[r].path, pathLength);
+        end += pathLength;
+        copied = replacements[r].offset + replacements[r].length;
+        free(replacements[r].path);
+    }
+    memcpy(end, line + copied, lineLength - copied + 1); // including the terminator
+    if (replacements != someReplacements) free(replacements);
     return local;
 }
 
-const int JSON_BUFFER_SIZE = 4096;
-static size_t write_json(char *in, size_t size, size_t nmemb, char *out)
+/* a response body, collected as it arrives */
+typedef struct {
+    char* text;                 /* always null-terminated */
+    size_t length;
+    size_t capacity;
+} ResponseBody;
+
+/* response write callback - adds the data to the end of the ResponseBody */
+static size_t write_response(char *in, size_t size, size_t nmemb, void *p)
 {
+    ResponseBody* body = p;
     size_t toRead = size * nmemb;
-    int alreadyRead = strlen(out);
-    if (toRead > JSON_BUFFER_SIZE-alreadyRead-1) toRead = JSON_BUFFER_SIZE-alreadyRead-1;
-    strncpy(out+alreadyRead, in, toRead);
-    *(out+alreadyRead+toRead) = '\0'; // ensure it's null terminated
+    if (body->length + toRead + 1 > body->capacity) {
+        // doubling means that collecting the body takes linear time however big it is
+        size_t capacity = body->capacity ? body->capacity : 4096;
+        while (body->length + toRead + 1 > capacity) capacity *= 2;
+        char* text = realloc(body->text, capacity);
+        if (!text) return 0; // out of memory, so fail the transfer
+        body->text = text;
+        body->capacity = capacity;
+    }
+    memcpy(body->text + body->length, in, toRead);
+    body->length += toRead;
+    body->text[body->length] = '\0';
     return toRead;
 }
 
+/* a file being gzipped as it's uploaded, a buffer at a time */
+typedef struct {
+    FILE* file;
+    z_stream stream;
+    unsigned char input[65536];
+    long long size;                     /* of the file before it's compressed, for reporting progress */
+    int finished;                       /* whether the whole gzip stream has been produced */
+} GzipUpload;
+
+/* upload read callback - compresses the next part of the file into curl's buffer */
+static size_t read_gzip(char *buffer, size_t size, size_t nitems, void *p)
+{
+    GzipUpload* upload = p;
+    upload->stream.next_out = (unsigned char*)buffer;
+    upload->stream.avail_out = (uInt)(size * nitems);
+    while (upload->stream.avail_out > 0 && !upload->finished) {
+        if (upload->stream.avail_in == 0 && !feof(upload->file)) {
+            upload->stream.next_in = upload->input;
+            upload->stream.avail_in = (uInt)fread(upload->input, 1, sizeof(upload->input), upload->file);
+            if (ferror(upload->file)) return CURL_READFUNC_ABORT;
+        }
+        int flush = upload->stream.avail_in == 0 && feof(upload->file) ? Z_FINISH : Z_NO_FLUSH;
+        int result = deflate(&upload->stream, flush);
+        if (result == Z_STREAM_END) upload->finished = 1;
+        else if (result == Z_STREAM_ERROR) return CURL_READFUNC_ABORT;
+    }
+    return size * nitems - upload->stream.avail_out;
+}
+
+/* upload seek callback - only rewinding is possible (e.g. to send the request again after a redirect) */
+static int seek_gzip(void *p, curl_off_t offset, int origin)
+{
+    GzipUpload* upload = p;
+    if (offset != 0 || origin != SEEK_SET) return CURL_SEEKFUNC_CANTSEEK;
+    rewind(upload->file);
+    deflateReset(&upload->stream);
+    upload->stream.avail_in = 0;
+    upload->finished = 0;
+    return CURL_SEEKFUNC_OK;
+}
+
+struct UploadBatch;
+
+/* an upload in progress */
+typedef struct {
+    struct UploadBatch* batch;
+    UploadRequest* request;
+    CURL* curl;
+    curl_mime* form;
+    GzipUpload* compressed;             /* if the file is being gzipped on the way */
+    ResponseBody body;
+    int queued;                         /* whether it's waiting for a free slot on the server */
+    int slotHeld;                       /* whether it has one of the server's slots */
+    int paused;                         /* whether it's making way for more urgent transfers */
+    curl_off_t now;                     /* bytes of the file sent so far */
+    curl_off_t total;                   /* bytes to send, or 0 if not known yet */
+} Upload;
+
+/* a set of files being uploaded at the same time */
+typedef struct UploadBatch {
+    Upload* uploads;
+    int count;
+    ProgressTransfer* progress;         /* where the batch's progress is reported, or NULL */
+} UploadBatch;
+
+/* upload progress callback - reports the progress of the whole batch, and holds the upload back
+ * while the user is waiting for other transfers */
+static int uploadProgress(void *p,
+                          curl_off_t dltotal, curl_off_t dlnow,
+                          curl_off_t ultotal, curl_off_t ulnow)
+{
+    Upload* upload = p;
+    if (upload->compressed) { // the compressed size isn't known until the end, so count what's been compressed so far
+        upload->now = upload->compressed->stream.total_in;
+        upload->total = upload->compressed->size;
+    } else {
+        upload->now = ulnow;
+        upload->total = ultotal;
+    }
+    UploadBatch* batch = upload->batch;
+    if (batch->progress) {
+        curl_off_t batchNow = 0;
+        curl_off_t batchTotal = 0;
+        for (int u = 0; u < batch->count; u++) {
+            batchNow += batch->uploads[u].now;
+            batchTotal += batch->uploads[u].total;
+        }
+        if (batchTotal > 0) {
+            progressUpdate(batch->progress, batchNow, batchTotal);
+        }
+    }
+    if (!upload->paused && shouldYield(TRANSFER_UPLOAD)) {
+        fprintf(stderr, "Pausing upload to %s\n", upload->request->url);
+        upload->paused = 1;
+        curl_easy_pause(upload->curl, CURLPAUSE_ALL);
+    }
+    return 0;
+}
+
+/* sets the given upload's error to the given message followed by the given detail */
+static void uploadError(Upload* upload, const char* message, const char* detail) {
+    upload->request->error = malloc(strlen(message) + strlen(detail) + 1);
+    sprintf(upload->request->error, "%s%s", message, detail);
+    fprintf(stderr, "Upload to %s failed: %s\n", upload->request->url, upload->request->error);
+}
+
+/* puts together the form for the given upload - returns 0 on success, or sets the request's error */
+static int prepareUpload(Upload* upload, int gzip) {
+    UploadRequest* request = upload->request;
+    upload->form = curl_mime_init(upload->curl);
+    curl_mimepart* part;
+    if (request->otherParameters) {
+        /* Fill in the other parameters */
+        const cJSON *parameter = NULL;
+        cJSON_ArrayForEach(parameter, request->otherParameters)
+        {
+            if (cJSON_IsString(parameter)) {
+                part = curl_mime_addpart(upload->form);
+                curl_mime_name(part, parameter->string);
+                curl_mime_data(part, parameter->valuestring, CURL_ZERO_TERMINATED);
+            } // string value
+        } // next parameter
+    } // there are other parameters
+    
+    /* Fill in the file upload field - the file is read as it's sent, rather than all at once */
+    char* name = strrchr(request->fileName, '/');
+    name = name ? name + 1 : request->fileName;
+    part = curl_mime_addpart(upload->form);
+    curl_mime_name(part, request->fileParameter);
+    if (gzip) { // send it as a .gz file, compressing it as it goes
+        GzipUpload* compressed = calloc(1, sizeof(GzipUpload));
+        compressed->file = fopen(request->fileName, "rb");
+        // windowBits + 16 means a gzip header and trailer
+        if (!compressed->file || deflateInit2(&compressed->stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            if (compressed->file) fclose(compressed->file);
+            free(compressed);
+            uploadError(upload, "Could not read ", request->fileName);
+            return -1;
+        }
+        struct stat status;
+        if (fstat(fileno(compressed->file), &status) == 0) compressed->size = status.st_size;
+        upload->compressed = compressed;
+        // the compressed size isn't known until the end, so the request is sent in chunks
+        curl_mime_data_cb(part, -1, read_gzip, seek_gzip, NULL, compressed);
+        char* gzipName = malloc(strlen(name) + 4);
+        sprintf(gzipName, "%s.gz", name);
+        curl_mime_filename(part, gzipName);
+        free(gzipName);
+        curl_mime_type(part, "application/gzip");
+    } else {
+        if (curl_mime_filedata(part, request->fileName) != CURLE_OK) {
+            uploadError(upload, "Could not read ", request->fileName);
+            return -1;
+        }
+        curl_mime_filename(part, name);
+        curl_mime_type(part, "application/octet-stream");
+    }
+    return 0;
+}
+
+/* sets up the transfer for the given upload - returns 0 on success, or sets the request's error */
+static int startUpload(Upload* upload, int gzip, struct curl_slist* headerlist) {
+    upload->curl = acquireHandle();
+    if (!upload->curl) {
+        upload->request->error = strdup("curl_easy_init() failed.");
+        return -1;
+    }
+    if (prepareUpload(upload, gzip) != 0) return -1;
+    CURL* curl = upload->curl;
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
+    curl_easy_setopt(curl, CURLOPT_URL, upload->request->url);
+    curl_easy_setopt(curl, CURLOPT_MIMEPOST, upload->form);
+    // capture and return response
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &upload->body);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, uploadProgress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, upload);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, upload);
+    // uploads to the same server share its connections, as downloads do
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    if (strncasecmp(upload->request->url, "https://", 8) == 0) curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)CONNECT_TIMEOUT_SECONDS);
+    return 0;
+}
+
+/* deals with the response to the given upload */
+static void finishUpload(Upload* upload, CURLcode res) {
+    UploadRequest* request = upload->request;
+    if (res != CURLE_OK) {
+        uploadError(upload, "", curl_easy_strerror(res));
+    } else {
+        curl_easy_getinfo(upload->curl, CURLINFO_RESPONSE_CODE, &request->status);
+        // make response available to caller
+        request->response = upload->body.text ? cJSON_Parse(upload->body.text) : NULL;
+        if (request->response == NULL) {
+            const char* jsonError = upload->body.text ? cJSON_GetErrorPtr() : NULL;
+            uploadError(upload, "JSON error before: ", jsonError ? jsonError : "(empty response)");
+        }
+    }
+}
+
+/* frees everything the given upload used (apart from its request) */
+static void cleanupUpload(Upload* upload) {
+    if (upload->curl) releaseHandle(upload->curl);
+    upload->curl = NULL;
+    curl_mime_free(upload->form);
+    upload->form = NULL;
+    if (upload->compressed) {
+        deflateEnd(&upload->compressed->stream);
+        fclose(upload->compressed->file);
+        free(upload->compressed);
+        upload->compressed = NULL;
+    }
+    free(upload->body.text);
+    upload->body.text = NULL;
+}
+
 /*
- * Upload the given file to the given URL.
- * Returns NULL on success, or an error message on failure.
+ * Uploads the given files at the same time, as many at once as their servers allow.
  */
-char* uploadFile(char* url, char* fileParameter, char* fileName, const cJSON* otherParameters, char* authorization, cJSON** response) {
-    char* error = NULL;
-    CURL* curl;
-    CURLcode res;
-    struct curl_httppost *formpost = NULL;
-    struct curl_httppost *lastptr = NULL;
+int uploadFiles(UploadRequest* requests, int count, int gzip, char* authorization, ProgressTransfer* progress) {
     struct curl_slist *headerlist = NULL;
     
     /* Ask for JSON */
     headerlist = curl_slist_append(headerlist, "Accept: application/json");
     
-    char* authorizationHeader = malloc(1024);
+    char* authorizationHeader = NULL;
     if (authorization) {
         /* add authorization header */
+        authorizationHeader = malloc(strlen(authorization) + 16);
         sprintf(authorizationHeader, "Authorization: %s", authorization);
         headerlist = curl_slist_append(headerlist, authorizationHeader);
     }
     
-    if (otherParameters) {
-        /* Fill in the other parameters */
-        const cJSON *parameter = NULL;
-        cJSON_ArrayForEach(parameter, otherParameters)
-        {
-            if (cJSON_IsString(parameter)) {
-                curl_formadd(&formpost,
-                             &lastptr,
-                             CURLFORM_COPYNAME, parameter->string,
-                             CURLFORM_COPYCONTENTS, parameter->valuestring,
-                             CURLFORM_END);
-            } // string value
-        } // next parameter
-    } // there are other parameters
+    Upload* uploads = calloc(count, sizeof(Upload));
+    UploadBatch batch = { uploads, count, progress };
+    for (int u = 0; u < count; u++) {
+        uploads[u].batch = &batch;
+        uploads[u].request = &requests[u];
+        requests[u].response = NULL;
+        requests[u].error = NULL;
+        requests[u].status = 0;
+        uploads[u].queued = 1;
+    }
     
-    /* Fill in the file upload field */
-    char* name = strrchr(fileName, '/') + 1;
-    if (!name) name = fileName;
-    curl_formadd(&formpost,
-                 &lastptr,
-                 CURLFORM_COPYNAME, fileParameter,
-                 CURLFORM_FILE, fileName,
-                 CURLFORM_FILENAME, name,
-                 CURLFORM_CONTENTTYPE, "application/octet-stream",
-                 CURLFORM_END);
-    curl = curl_easy_init();
-    if(curl) {
-
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist);
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_HTTPPOST, formpost);
-        // capture and return response
-        char jsonString[JSON_BUFFER_SIZE];
-        jsonString[0] = '\0';
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_json);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, jsonString);
-
-        /* Perform the request, res will get the return code */
-        res = curl_easy_perform(curl);
-        /* Check for errors */
-        if(res != CURLE_OK) {
-            error = curl_easy_strerror(res);
-            fprintf(stderr, "upload error %s\n", error);
-        } else {
-            // make response available to caller
-            (*response) = cJSON_Parse(jsonString);
-            if ((*response) == NULL) {
-                char* jsonError = cJSON_GetErrorPtr();
-                error = malloc(strlen(jsonError) + 20);
-                sprintf(error, "JSON error before: %s\n", jsonError);
-                fprintf(stderr, "%s\n", error);
+    // start as many transfers at once as the servers allow, and wait until they've all finished
+    CURLM* multi = threadMulti();
+    int running = 0;
+    int queued = count;
+    while (running > 0 || queued > 0) {
+        if (transfersStopped) break;
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "curl_multi failed: %s\n", curl_multi_strerror(mc));
+            break;
+        }
+        CURLMsg* message;
+        int messagesLeft;
+        while ((message = curl_multi_info_read(multi, &messagesLeft))) {
+            if (message->msg == CURLMSG_DONE) {
+                Upload* upload = NULL;
+                curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char**)&upload);
+                finishUpload(upload, message->data.result);
+                curl_multi_remove_handle(multi, upload->curl);
+                cleanupUpload(upload);
+                // let the next transfer to the server start
+                releaseHostSlot(upload->request->url);
+                upload->slotHeld = 0;
+            }
+        } // next message
+        if (queued > 0 && !shouldYield(TRANSFER_UPLOAD)) {
+            int started = 0;
+            for (int u = 0; u < count; u++) {
+                Upload* upload = &uploads[u];
+                if (!upload->queued || !acquireHostSlot(upload->request->url, TRANSFER_UPLOAD)) continue;
+                upload->queued = 0;
+                queued--;
+                upload->slotHeld = 1;
+                if (startUpload(upload, gzip, headerlist) == 0) {
+                    curl_multi_add_handle(multi, upload->curl);
+                    running++;
+                    started++;
+                } else {
+                    cleanupUpload(upload);
+                    releaseHostSlot(upload->request->url);
+                    upload->slotHeld = 0;
+                }
             }
+            if (started > 0) continue; // get them going straight away
         }
-        
-        /* always cleanup */
-        curl_easy_cleanup(curl);
-        
-        /* then cleanup the formpost chain */
-        curl_formfree(formpost);
-        /* free slist */
-        curl_slist_free_all(headerlist);
-    } else { // curl_easy_init failed
-        error = "curl_easy_init() failed.";
-    }
-    //fprintf(stderr, "returning from uploadFile: %s\n", error);
+        if (running == 0) {
+            if (queued > 0) waitForScheduler(100); // all the servers' slots are taken, or the user is waiting for something
+            continue;
+        }
+        // resume paused uploads once nothing more urgent is going on
+        int paused = 0;
+        for (int u = 0; u < count; u++) {
+            Upload* upload = &uploads[u];
+            if (!upload->paused) continue;
+            if (shouldYield(TRANSFER_UPLOAD)) {
+                paused = 1;
+            } else {
+                fprintf(stderr, "Resuming upload to %s\n", upload->request->url);
+                upload->paused = 0;
+                curl_easy_pause(upload->curl, CURLPAUSE_CONT);
+            }
+        }
+        mc = curl_multi_wait(multi, NULL, 0, paused ? 100 : 1000, NULL);
+        if (mc != CURLM_OK) {
+            fprintf(stderr, "curl_multi failed: %s\n", curl_multi_strerror(mc));
+            break;
+        }
+    } // still running
+    
+    int failed = 0;
+    for (int u = 0; u < count; u++) {
+        Upload* upload = &uploads[u];
+        if (upload->curl) {
+            curl_multi_remove_handle(multi, upload->curl);
+            if (!upload->request->error) upload->request->error = strdup("Upload interrupted.");
+        } else if (upload->queued && !upload->request->error) {
+            upload->request->error = strdup("Upload not started.");
+        }
+        cleanupUpload(upload);
+        if (upload->slotHeld) releaseHostSlot(upload->request->url);
+        if (upload->request->error) failed++;
+    }
+    free(uploads);
+    curl_slist_free_all(headerlist);
     free(authorizationHeader);
-    return error;
+    return failed;
+}
+
+/*
+ * Upload the given file to the given URL.
+ * Returns NULL on success, or an error message on failure.
+ */
+char* uploadFile(char* url, char* fileParameter, char* fileName, int gzip, const cJSON* otherParameters, char* authorization, ProgressTransfer* progress, cJSON** response) {
+    UploadRequest request = { url, fileParameter, fileName, otherParameters, NULL, NULL };
+    uploadFiles(&request, 1, gzip, authorization, progress);
+    *response = request.response;
+    return request.error;
+}
+
+/*
+ * Returns whether the local copy of the given URL still has the content it was downloaded with.
+ */
+int localCopyUnchanged(const char* url) {
+    char* path = NULL;
+    unsigned long long contentHash = 0;
+    LocalFile* local;
+    pthread_mutex_lock(&urlToLocalLock);
+    if (urlToLocal && hashmap_get(urlToLocal, (char*)url, (void**)(&local)) == MAP_OK) {
+        path = strdup(local->path);
+        contentHash = local->contentHash;
+    }
+    pthread_mutex_unlock(&urlToLocalLock);
+    if (!path) { // not downloaded by this process, but maybe by an earlier one
+        CacheEntry entry;
+        // the size and modification time can't be trusted - a label edited within the same second changes neither
+        cacheLookup(url, &entry);
+        if (!*entry.path) return 0;
+        path = strdup(entry.path);
+        contentHash = entry.contentHash;
+    }
+    int unchanged = 0;
+    if (contentHash) { // otherwise we can't tell
+        CacheHasher hasher;
+        cacheHasherStart(&hasher);
+        unchanged = cacheHasherAddFile(&hasher, path) == 0 && cacheHasherFinish(&hasher) == contentHash;
+    }
+    free(path);
+    return unchanged;
 }
 
-int deleteFile(any_t item, any_t data) {
-    if (remove(data) != 0) fprintf(stderr, "Could not delete: %s\n", data);
+int forgetFile(any_t item, any_t data) {
+    LocalFile* local = data;
+    free(local->url);
+    free(local->path);
+    free(local);
     return MAP_OK;
 }
 
 /*
- * Cleans up, by deleting downloaded files.
+ * Stops transfers that are going (e.g. in background threads) within a second or so, and any more from starting.
+ */
+void stopTransfers(void) {
+    transfersStopped = 1;
+}
+
+/*
+ * Cleans up, by forgetting which URLs were downloaded to which files, and closing connections.
+ * The files themselves are left in the cache for next time (apart from any kept in memory).
  */
 void cleanupDownloads(void) {
-    hashmap_iterate(urlToLocal, deleteFile, NULL);
-    hashmap_free(urlToLocal);
+    pthread_mutex_lock(&urlToLocalLock);
+    if (urlToLocal) {
+        hashmap_iterate(urlToLocal, forgetFile, NULL);
+        hashmap_free(urlToLocal);
+        urlToLocal = NULL;
+    }
+    pthread_mutex_unlock(&urlToLocalLock);
+    memoryFilesRelease();
+    if (share) {
+        WebStatistics totals = getWebStatistics();
+        fprintf(stderr, "%ld transfers, %ld connections opened (%.3fs DNS, %.3fs connect, %.3fs TLS)\n",
+                totals.transfers, totals.connectionsOpened,
+                totals.nameLookupSeconds, totals.connectSeconds, totals.tlsSeconds);
+        pthread_mutex_lock(&handlePoolLock);
+        while (handlePoolCount > 0) curl_easy_cleanup(handlePool[--handlePoolCount]);
+        pthread_mutex_unlock(&handlePoolLock);
+        CURLM* multi = pthread_getspecific(multiKey);
+        if (multi) {
+            curl_multi_cleanup(multi);
+            pthread_setspecific(multiKey, NULL);
+        }
+        curl_share_cleanup(share);
+    }
 }
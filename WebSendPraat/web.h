@@ -12,30 +12,124 @@
 #include <stdio.h>
 #include "sendpraat.h"
 #include "cjson/cJSON.h"
+#include "progress.h"
+
+/*
+ * How urgently a transfer is needed, which decides who gets connections and bandwidth first.
+ * While there are interactive transfers in progress, other transfers are paused.
+ */
+typedef enum {
+    TRANSFER_INTERACTIVE,   /* something the user is waiting for, e.g. files to open in Praat */
+    TRANSFER_PREFETCH,      /* files that might be wanted later */
+    TRANSFER_UPLOAD         /* files being sent back to the server */
+} TransferPriority;
 
 /*
  * Converts all http:// and https:// URLs in the given script line to local file paths,
  * by downloading the content to a local file.
+ * Downloads are kept in a persistent cache, so a URL that's already been downloaded is only
+ * transferred again if the server says it has changed.
+ * If it fails, *error is set to why (which the caller must free).
  * The caller is responsible for freeing the returned string.
  */
-char* downloadHttpToLocal(char* line, char* authorization, void (*downloadProgress)(long,long), char** error);
+char* downloadHttpToLocal(char* line, char* authorization, ProgressTransfer* progress, char** error);
+
+/* results of downloadAllHttpToLocal() */
+#define DOWNLOAD_OK 0
+#define DOWNLOAD_FAILED 1
+#define DOWNLOAD_TIMED_OUT 2
+
+/*
+ * Downloads all http:// and https:// URLs in the given script lines at the same time,
+ * so that the lines can then be converted to local file paths using rewriteHttpToLocal().
+ * The priority decides which transfers go first when there are others in progress.
+ * The timeout is how many milliseconds the downloads may take altogether, or 0 for no limit.
+ * The progress of the whole batch is reported to the given transfer, if it's not NULL.
+ * Transfers the user is waiting for that lag well behind the server's usual pace
+ * (or won't make the timeout at the rate they're going) are hedged with a second request.
+ * Returns DOWNLOAD_OK, or DOWNLOAD_FAILED or DOWNLOAD_TIMED_OUT with *error set to why
+ * (which the caller must free).
+ */
+int downloadAllHttpToLocal(char** lines, int lineCount, TransferPriority priority, long timeout, char* authorization, ProgressTransfer* progress, char** error);
 
 /*
  * Finds all http:// or https:// URLs in the given script line and,
- * if they have already been downloaded using convertHttpToLocal() to local file paths,
+ * if they have already been downloaded using downloadHttpToLocal() to local file paths,
  * rewrites them as local file names.
+ * URLs may be on their own or inside quotes; the rest of the line is left exactly as it is.
+ * The given line isn't changed, so this can be called from any thread.
  * The caller is responsible for freeing the returned string.
  */
-char* rewriteHttpToLocal(char* line);
+char* rewriteHttpToLocal(const char* line);
+
+/*
+ * Returns whether the local copy of the given URL (downloaded with downloadHttpToLocal())
+ * still has the content it was downloaded with, e.g. because Praat saved a TextGrid that
+ * hadn't been edited - in which case there's no need to upload it again.
+ * Returns 0 if it's changed, or if there's no local copy or it can't be told.
+ */
+int localCopyUnchanged(const char* url);
+
+/* A file to upload with uploadFiles() */
+typedef struct {
+    char* url;                          /* where to upload it */
+    char* fileParameter;                /* the name of the form field for the file */
+    char* fileName;                     /* the local file */
+    const cJSON* otherParameters;       /* other form fields (strings), or NULL */
+    cJSON* response;                    /* set to the server's JSON response, if the upload succeeds */
+    char* error;                        /* set to why it failed (which the caller must free) if it doesn't */
+    long status;                        /* set to the HTTP response code, or 0 if the server didn't respond */
+} UploadRequest;
+
+/*
+ * Uploads the given files at the same time - as many at once as their servers allow,
+ * sharing connections - filling in each request's response or error.
+ * If gzip is true, the files are compressed as they're sent, as .gz files of type application/gzip.
+ * Progress of all the uploads together is reported to the given transfer, if it's not NULL.
+ * Returns how many of the uploads failed.
+ */
+int uploadFiles(UploadRequest* requests, int count, int gzip, char* authorization, ProgressTransfer* progress);
 
 /*
  * Upload the given file to the given URL.
+ * If gzip is true, the file is compressed as it's sent, as a .gz file of type application/gzip.
+ * Progress is reported to the given transfer, if it's not NULL.
  * Returns NULL on success, or an error message on failure.
  */
-char* uploadFile(char* url, char* fileParameter, char* fileName, const cJSON* otherParameters, char* authorization, cJSON** response);
+char* uploadFile(char* url, char* fileParameter, char* fileName, int gzip, const cJSON* otherParameters, char* authorization, ProgressTransfer* progress, cJSON** response);
+
+/*
+ * Counters for all transfers so far, which show how much time is spent setting up connections.
+ * Connections, DNS lookups and TLS sessions are shared between transfers, so repeat requests to
+ * the same server should open few connections and spend little time on setup.
+ */
+typedef struct {
+    long transfers;
+    long connectionsOpened;
+    double nameLookupSeconds;
+    double connectSeconds;
+    double tlsSeconds;
+    double totalSeconds;
+    long hedges;                /* second requests sent for lagging transfers */
+    long hedgesWon;             /* second requests that finished first */
+} WebStatistics;
+
+/*
+ * Returns counters for all transfers so far.
+ */
+WebStatistics getWebStatistics(void);
+
+/*
+ * Stops transfers that are going (e.g. in background threads) within a second or so, and any more
+ * from starting, which then fail.
+ * Partial downloads are kept, to be resumed next time.
+ */
+void stopTransfers(void);
 
 /*
- * Cleans up, by deleting downloaded files.
+ * Cleans up, by forgetting which URLs were downloaded to which files, and closing connections.
+ * The files themselves are left in the cache for next time (apart from any kept in memory).
+ * No other thread may be transferring anything (see stopTransfers()).
  */
 void cleanupDownloads(void);
 
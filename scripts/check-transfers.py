@@ -0,0 +1,504 @@
+#!/usr/bin/env python3
+#
+#  check-transfers.py
+#  WebSendPraat
+#
+#  Runs websendpraat against a local HTTP server that misbehaves in controlled ways, and checks
+#  that what ends up in the cache (or in the server's hands) is right.
+#
+#  Usage:
+#    scripts/check-transfers.py path/to/websendpraat [check ...]
+#
+#  With no checks named, all of them are run. The checks are meant for a Linux build, where
+#  sendpraat doesn't need Praat to be running (it's compiled with NO_GUI), e.g.
+#    gcc -DUNIX -DNO_GUI -DTRUE=1 -DFALSE=0 -o websendpraat WebSendPraat/*.c \
+#        WebSendPraat/cjson/cJSON.c WebSendPraat/c_hashmap/hashmap.c -lcurl -lpthread -lz
+#
+#  Copyright © 2018 New Zealand Institute of Language, Brain and Behaviour. All rights reserved.
+#
+
+import glob, gzip, hashlib, http.server, json, os, queue, shutil, socket, socketserver, struct
+import subprocess, sys, tempfile, threading, time, zlib
+
+def wav(seconds, rate=8000):
+    """ a mono 16-bit WAV file of the given length """
+    samples = b"".join(struct.pack("<h", (i * 7) % 3000) for i in range(rate * seconds))
+    return (b"RIFF" + struct.pack("<I", 36 + len(samples)) + b"WAVEfmt "
+            + struct.pack("<IHHIIHH", 16, 1, 1, rate, rate * 2, 2, 16)
+            + b"data" + struct.pack("<I", len(samples)) + samples)
+
+def textGrid(intervals):
+    """ a TextGrid with the given number of intervals """
+    lines = ['File type = "ooTextFile"', 'Object class = "TextGrid"', "",
+             "xmin = 0", "xmax = %d" % intervals, "tiers? <exists>", "size = 1", "item []:"]
+    for i in range(intervals):
+        lines += ["        intervals [%d]:" % (i + 1), "            xmin = %d" % i,
+                  "            xmax = %d" % (i + 1), '            text = "word %d"' % i]
+    return ("\n".join(lines) + "\n").encode()
+
+# what the server serves, by path
+FILES = {
+    "/big.TextGrid": textGrid(30000),
+    "/small.TextGrid": textGrid(3),
+    "/ten.wav": wav(10),
+}
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+    def __init__(self):
+        super().__init__(("127.0.0.1", 0), Handler)
+        self.requests = []      # (method, path, headers) of each request, in the order they arrived
+        self.uploads = []       # (path, headers, file name, file content) of each upload
+        self.seen = set()
+        self.lock = threading.Lock()
+        self.url = "http://127.0.0.1:%d" % self.server_address[1]
+        threading.Thread(target=self.serve_forever, daemon=True).start()
+
+    def handle_error(self, request, address):
+        if not isinstance(sys.exc_info()[1], ConnectionError): # e.g. a host that was killed
+            super().handle_error(request, address)
+
+    def requested(self, path):
+        """ the headers of each request for the given path (ignoring the query) """
+        with self.lock:
+            return [headers for method, p, headers in self.requests if p.split("?")[0] == path]
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    """ Serves FILES, with conditional and range requests. The query string changes its behaviour:
+     *  drop     - the first response for the URL is cut off half way through
+     *  enc=X    - the content is sent with Content-Encoding X (gzip or deflate), if the client accepts it
+     *  delay=S  - every response waits S seconds before starting
+     *  stall=S  - the first response for the URL waits S seconds before starting
+     *  rate=B   - the content is sent at B bytes a second """
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *arguments):
+        pass
+
+    def option(self, name):
+        query = self.path.partition("?")[2]
+        for parameter in query.split("&"):
+            key, _, value = parameter.partition("=")
+            if key == name: return value or True
+        return None
+
+    def do_GET(self):
+        path = self.path.split("?")[0]
+        with self.server.lock:
+            first = self.path not in self.server.seen
+            self.server.seen.add(self.path)
+            self.server.requests.append(("GET", self.path, dict(self.headers)))
+        if self.option("delay"): time.sleep(float(self.option("delay")))
+        if self.option("stall") and first: time.sleep(float(self.option("stall")))
+        data = FILES.get(path)
+        if data is None:
+            self.send_response(404)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        etag = '"%s"' % hashlib.md5(data).hexdigest()
+        if self.headers.get("If-None-Match") == etag:
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        status, body, extra, encoding = 200, data, {}, self.option("enc")
+        wanted = self.headers.get("Range")
+        if wanted and wanted.startswith("bytes=") and self.headers.get("If-Range", etag) == etag:
+            start, _, end = wanted[6:].partition("-")
+            start, end = int(start), min(int(end) if end else len(data) - 1, len(data) - 1)
+            status, body = 206, data[start:end + 1]
+            extra["Content-Range"] = "bytes %d-%d/%d" % (start, end, len(data))
+        elif encoding and encoding in self.headers.get("Accept-Encoding", ""):
+            body = gzip.compress(data) if encoding == "gzip" else zlib.compress(data)
+            extra["Content-Encoding"] = encoding
+        self.send_response(status)
+        self.send_header("ETag", etag)
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("Content-Length", str(len(body)))
+        for name, value in extra.items(): self.send_header(name, value)
+        self.end_headers()
+        if self.option("drop") and first and status == 200:
+            self.wfile.write(body[:len(body) // 2])
+            self.wfile.flush()
+            self.connection.shutdown(socket.SHUT_RDWR)
+            self.close_connection = True
+            return
+        try:
+            if self.option("rate"):
+                rate = int(self.option("rate"))
+                for start in range(0, len(body), rate // 10):
+                    self.wfile.write(body[start:start + rate // 10])
+                    self.wfile.flush()
+                    time.sleep(0.1)
+            else:
+                self.wfile.write(body)
+        except OSError:
+            pass # the client gave up on it
+
+    def do_POST(self):
+        """ accepts a multipart upload, recording the file it contains (unzipped if it's gzipped) """
+        if self.headers.get("Transfer-Encoding") == "chunked":
+            body = b""
+            while True:
+                size = int(self.rfile.readline().split(b";")[0], 16)
+                body += self.rfile.read(size)
+                self.rfile.readline()
+                if size == 0: break
+        else:
+            body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        boundary = b"--" + self.headers.get("Content-Type").split("boundary=")[1].encode()
+        for part in body.split(boundary)[1:-1]:
+            headers, _, content = part[2:-2].partition(b"\r\n\r\n")
+            if b"filename=" not in headers: continue
+            name = headers.split(b'filename="')[1].split(b'"')[0].decode()
+            if name.endswith(".gz"): content = gzip.decompress(content)
+            with self.server.lock:
+                self.server.requests.append(("POST", self.path, dict(self.headers)))
+                self.server.uploads.append((self.path, dict(self.headers), name, content))
+        response = b'{ "model" : { "result" : "uploaded" } }'
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(response)))
+        self.end_headers()
+        self.wfile.write(response)
+
+def run(command, environment, timeout=60):
+    """ runs websendpraat on the command line, and returns its exit status """
+    return subprocess.run(command, env=environment, stdout=subprocess.DEVNULL,
+                          stderr=subprocess.DEVNULL, timeout=timeout).returncode
+
+class Host:
+    """ websendpraat run as a native messaging host """
+    def __init__(self, program, environment):
+        self.process = subprocess.Popen([program, "chrome-extension://check"], env=environment,
+                                        stdin=subprocess.PIPE, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL)
+        self.messages = queue.Queue()
+        threading.Thread(target=self.receive, daemon=True).start()
+
+    def receive(self):
+        while True:
+            length = self.process.stdout.read(4)
+            if len(length) < 4: break
+            message = json.loads(self.process.stdout.read(struct.unpack("=I", length)[0]))
+            if message.get("message") != "progress": self.messages.put(message)
+
+    def post(self, message):
+        """ sends the given message without waiting for the reply """
+        data = json.dumps(message).encode()
+        self.process.stdin.write(struct.pack("=I", len(data)) + data)
+        self.process.stdin.flush()
+
+    def send(self, message, timeout=60):
+        """ sends the given message, and returns the reply """
+        self.post(message)
+        return self.next(timeout)
+
+    def next(self, timeout=60):
+        """ the next message from the host (other than progress) """
+        try:
+            return self.messages.get(timeout=timeout)
+        except queue.Empty:
+            raise Failure("no message from the host within %ds" % timeout)
+
+    def close(self):
+        self.process.stdin.close()
+        self.process.wait(30)
+
+class Check:
+    """ a fresh cache, server and environment for one check """
+    def __init__(self, program):
+        self.program = os.path.abspath(program)
+        self.cache = tempfile.mkdtemp(prefix="websendpraat-check-")
+        self.environment = dict(os.environ, WEBSENDPRAAT_CACHE=self.cache)
+        self.environment.pop("WEBSENDPRAAT_MEMORY_FILE_SIZE", None)
+        self.server = Server()
+        self.url = self.server.url
+        self.hosts = []
+
+    def close(self):
+        for host in self.hosts:
+            if host.process.poll() is None: host.process.kill() # e.g. the check failed waiting for it
+        self.server.shutdown()
+        self.server.server_close()
+        shutil.rmtree(self.cache, ignore_errors=True)
+
+    def forget(self):
+        """ empties the cache """
+        for path in glob.glob(os.path.join(self.cache, "*")):
+            shutil.rmtree(path) if os.path.isdir(path) else os.remove(path)
+
+    def read(self, *urls):
+        """ opens the given URLs in Praat from the command line, returning the exit status """
+        lines = ["Read from file... " + url for url in urls]
+        return run([self.program, "0", "praat"] + lines, self.environment)
+
+    def host(self):
+        """ starts websendpraat as a native messaging host """
+        self.hosts.append(Host(self.program, self.environment))
+        return self.hosts[-1]
+
+    def cached(self, name):
+        """ the content of the cached file with the given name """
+        paths = glob.glob(os.path.join(self.cache, "*", name))
+        expect(len(paths) == 1, "%d cached copies of %s" % (len(paths), name))
+        with open(paths[0], "rb") as file:
+            return file.read()
+
+class Failure(Exception):
+    pass
+
+def expect(condition, message):
+    if not condition: raise Failure(message)
+
+def checkEncodings(check):
+    """ compressed responses are decompressed as they arrive, so the cached copy is the original """
+    for encoding in ("gzip", "deflate"):
+        expect(check.read(check.url + "/big.TextGrid?enc=" + encoding) == 0, "download failed")
+        expect(check.cached("big.TextGrid") == FILES["/big.TextGrid"], encoding + " copy differs")
+        expect(encoding in check.server.requested("/big.TextGrid")[-1].get("Accept-Encoding", ""),
+               encoding + " not accepted")
+        check.forget()
+
+def checkResume(check):
+    """ a download that's cut off is resumed from where it stopped, rather than starting again """
+    expect(check.read(check.url + "/big.TextGrid?drop") == 0, "download failed")
+    requests = check.server.requested("/big.TextGrid")
+    expect(len(requests) == 2, "%d requests" % len(requests))
+    expect(requests[1].get("Range") == "bytes=%d-" % (len(FILES["/big.TextGrid"]) // 2),
+           "resumed with Range: %s" % requests[1].get("Range"))
+    expect(check.cached("big.TextGrid") == FILES["/big.TextGrid"], "resumed copy differs")
+
+def checkRange(check):
+    """ only the samples in a WAV file's media fragment are downloaded """
+    expect(check.read(check.url + "/ten.wav#t=2.5,4") == 0, "download failed")
+    ranges = [headers.get("Range") for headers in check.server.requested("/ten.wav")]
+    # 2.5s to 4s of 8kHz 16-bit samples, after the 44-byte header
+    expect(ranges[-1] == "bytes=%d-%d" % (44 + 2.5 * 16000, 44 + 4 * 16000 - 1), "asked for %s" % ranges)
+    excerpt = check.cached("ten_2.5-4.wav")
+    expect(excerpt[44:] == FILES["/ten.wav"][44 + 40000:44 + 64000], "excerpt's samples differ")
+    expect(struct.unpack("<I", excerpt[40:44])[0] == 24000, "excerpt's header has the wrong size")
+
+def checkTimeout(check):
+    """ a message's downloads are given up on when its timeout runs out, with a code that says so """
+    host = check.host()
+    started = time.time()
+    reply = host.send({ "message" : "sendpraat", "timeout" : 1000,
+                        "sendpraat" : [ "praat", "Read from file... " + check.url + "/small.TextGrid?delay=5" ] })
+    elapsed = time.time() - started
+    host.close()
+    expect(reply.get("code") == 601, "code %s: %s" % (reply.get("code"), reply.get("error")))
+    expect(elapsed < 3, "gave up after %.1fs" % elapsed)
+
+def checkExitStatus(check):
+    """ the command line's exit status says whether sending or downloading failed """
+    expect(check.read(check.url + "/small.TextGrid") == 0, "download failed")
+    status = check.read(check.url + "/missing.TextGrid")
+    expect(status == 2, "exit status %d for a missing file" % status)
+
+def checkHedging(check):
+    """ a request that stalls is hedged with another, which finishes first """
+    host = check.host()
+    started = time.time()
+    reply = host.send({ "message" : "sendpraat",
+                        "sendpraat" : [ "praat", "Read from file... " + check.url + "/big.TextGrid?stall=10" ] })
+    elapsed = time.time() - started
+    statistics = host.send({ "message" : "statistics" })
+    host.close()
+    expect(reply.get("code") == 0, "code %s: %s" % (reply.get("code"), reply.get("error")))
+    expect(elapsed < 8, "took %.1fs" % elapsed)
+    expect(statistics.get("hedges", 0) >= 1 and statistics.get("hedgesWon", 0) >= 1,
+           "%s hedges, %s won" % (statistics.get("hedges"), statistics.get("hedgesWon")))
+    expect(check.cached("big.TextGrid") == FILES["/big.TextGrid"], "hedged copy differs")
+
+def checkConcurrency(check):
+    """ files from the same server are downloaded at once - over several connections, since there's
+     no HTTP/2 to multiplex them on - and the connections are reused by later messages """
+    host = check.host()
+    names = [ "/small.TextGrid?delay=2&file=%d" % i for i in range(6) ]
+    started = time.time()
+    reply = host.send({ "message" : "sendpraat",
+                        "sendpraat" : [ "praat" ] + [ "Read from file... " + check.url + name for name in names ] })
+    elapsed = time.time() - started
+    first = host.send({ "message" : "statistics" })
+    again = host.send({ "message" : "sendpraat",
+                        "sendpraat" : [ "praat" ] + [ "Read from file... " + check.url + name + "&again" for name in names ] })
+    second = host.send({ "message" : "statistics" })
+    host.close()
+    expect(reply.get("code") == 0 and again.get("code") == 0, "code %s/%s" % (reply.get("code"), again.get("code")))
+    expect(elapsed < 5, "6 files took %.1fs" % elapsed)
+    expect(first.get("connectionsOpened", 0) >= 2, "%s connections" % first.get("connectionsOpened"))
+    expect(second.get("connectionsOpened") == first.get("connectionsOpened"),
+           "%s then %s connections" % (first.get("connectionsOpened"), second.get("connectionsOpened")))
+
+def checkLongScripts(check):
+    """ scripts of tens of thousands of lines get to Praat, and take time in proportion to their length """
+    host = check.host()
+    elapsed = []
+    for lines in (20000, 80000):
+        script = [ "praat", "Read from file... " + check.url + "/small.TextGrid" ]
+        script += [ 'Create Sound from formula: "s%d", 1, 0, 0.01, 8000, "0"' % i for i in range(lines) ]
+        started = time.time()
+        reply = host.send({ "message" : "sendpraat", "sendpraat" : script })
+        elapsed.append(time.time() - started)
+        expect(reply.get("code") == 0, "code %s for %d lines: %s" % (reply.get("code"), lines, reply.get("error")))
+    host.close()
+    # four times the lines should take about four times as long - sixteen if assembling them were quadratic
+    expect(elapsed[1] < 0.5 or elapsed[1] < elapsed[0] * 8,
+           "%.2fs for 20000 lines, %.2fs for 80000" % (elapsed[0], elapsed[1]))
+
+def checkUpload(check):
+    """ an edited file is uploaded intact, both as it is and gzipped (which is streamed, so it's chunked) """
+    host = check.host()
+    fileUrl = check.url + "/big.TextGrid"
+    reply = host.send({ "message" : "sendpraat", "sendpraat" : [ "praat", "Read from file... " + fileUrl ] })
+    expect(reply.get("code") == 0, "download failed: %s" % reply.get("error"))
+    for gzipped in (False, True):
+        # Praat isn't really there to write the file, so edit it here instead
+        path = glob.glob(os.path.join(check.cache, "*", "big.TextGrid"))[0]
+        with open(path, "ab") as file:
+            file.write(b"# edited %s\n" % str(gzipped).encode())
+        with open(path, "rb") as file:
+            edited = file.read()
+        reply = host.send({ "message" : "upload", "gzip" : gzipped,
+                            "sendpraat" : [ "praat", "select TextGrid big", "Write to text file... " + fileUrl ],
+                            "uploadUrl" : check.url + "/upload", "fileParameter" : "uploadfile", "fileUrl" : fileUrl,
+                            "otherParameters" : { "id" : "big" } })
+        expect(reply.get("code") == 0, "upload failed: %s" % reply.get("error"))
+        expect(reply.get("model", {}).get("result") == "uploaded", "server's response not passed on: %s" % reply)
+        expect(len(check.server.uploads) == 1 + gzipped, "%d uploads" % len(check.server.uploads))
+        path, headers, name, content = check.server.uploads[-1]
+        expect(name == ("big.TextGrid.gz" if gzipped else "big.TextGrid"), "uploaded as " + name)
+        expect(content == edited, "uploaded content differs")
+        if gzipped: expect(headers.get("Transfer-Encoding") == "chunked", "gzipped upload wasn't streamed")
+    host.close()
+
+def checkSharedTransfer(check):
+    """ a request that joins a prefetch's transfer gets its file as soon as that transfer is done,
+     rather than waiting for the rest of the prefetch, which mustn't make way for a request that's only waiting """
+    host = check.host()
+    grid = check.url + "/small.TextGrid?delay=1"
+    host.post({ "message" : "prefetch", "urls" : [ grid, check.url + "/ten.wav?rate=32000" ], "clientRef" : "prefetch" })
+    time.sleep(0.3)
+    started = time.time()
+    host.post({ "message" : "sendpraat", "sendpraat" : [ "praat", "Read from file... " + grid ], "clientRef" : "user" })
+    replies = {}
+    while "user" not in replies or "prefetched" not in replies:
+        message = host.next(30)
+        if message.get("clientRef") == "user": replies["user"] = (message, time.time() - started)
+        if message.get("message") == "prefetched": replies["prefetched"] = (message, time.time() - started)
+    host.close()
+    reply, elapsed = replies["user"]
+    expect(reply.get("code") == 0, "code %s: %s" % (reply.get("code"), reply.get("error")))
+    expect(elapsed < 3, "reply after %.1fs" % elapsed)
+    prefetched, elapsed = replies["prefetched"]
+    expect(prefetched.get("code") == 0, "prefetch code %s: %s" % (prefetched.get("code"), prefetched.get("error")))
+    expect(len(check.server.requested("/small.TextGrid")) == 1, "the TextGrid was downloaded twice")
+
+def checkUnchangedUpload(check):
+    """ a file downloaded by an earlier process is only skipped if its content is unchanged,
+     even if an edit kept its size and modification time (e.g. one letter changed within a second) """
+    fileUrl = check.url + "/small.TextGrid"
+    expect(check.read(fileUrl) == 0, "download failed")
+    upload = { "message" : "upload", "fileUrl" : fileUrl, "uploadUrl" : check.url + "/upload",
+               "fileParameter" : "uploadfile", "sendpraat" : [ "praat", "Write to text file... " + fileUrl ] }
+    host = check.host()
+    reply = host.send(upload)
+    expect(reply.get("code") == 0 and reply.get("modified") is False, "unedited file: %s" % reply)
+    path = glob.glob(os.path.join(check.cache, "*", "small.TextGrid"))[0]
+    status = os.stat(path)
+    with open(path, "rb") as file:
+        edited = file.read().replace(b"word 1", b"ward 1")
+    with open(path, "wb") as file:
+        file.write(edited)
+    os.utime(path, ns=(status.st_atime_ns, status.st_mtime_ns))
+    reply = host.send(upload)
+    host.close()
+    expect(reply.get("code") == 0 and reply.get("modified") is not False, "edited file not uploaded: %s" % reply)
+    expect(check.server.uploads and check.server.uploads[-1][3] == edited, "uploaded content differs")
+
+def checkMemoryFiles(check):
+    """ small files are kept in memory by the host, which lets go of each one when it's downloaded again,
+     but written to disk by the command line, which exits before Praat reads them
+     (this takes over 30s, as files aren't downloaded again until then) """
+    check.environment["WEBSENDPRAAT_MEMORY_FILE_SIZE"] = "1024"
+    fileUrl = check.url + "/small.TextGrid"
+    expect(check.read(fileUrl) == 0, "download failed")
+    expect(not glob.glob(os.path.join(check.cache, "memory", "*", "small.TextGrid")), "kept in memory by the command line")
+    check.cached("small.TextGrid")
+    check.forget()
+    host = check.host()
+    for attempt in range(2):
+        if attempt: time.sleep(31) # until it's no longer fresh
+        reply = host.send({ "message" : "sendpraat", "sendpraat" : [ "praat", "Read from file... " + fileUrl ] })
+        expect(reply.get("code") == 0, "code %s: %s" % (reply.get("code"), reply.get("error")))
+    links = glob.glob(os.path.join(check.cache, "memory", "*", "small.TextGrid"))
+    fds = [ os.readlink(fd) for fd in glob.glob("/proc/%d/fd/*" % host.process.pid) ]
+    memoryFds = [ fd for fd in fds if fd.startswith("/memfd:") ]
+    host.close()
+    expect(len(check.server.requested("/small.TextGrid")) == 3, "not downloaded again")
+    expect(len(links) == 1, "%d links to in-memory copies" % len(links))
+    expect(len(memoryFds) == 1, "%d in-memory files" % len(memoryFds))
+
+def checkUploadBatch(check):
+    """ many files are uploaded with one message, and a message with none is answered straight away """
+    host = check.host()
+    reply = host.send({ "message" : "uploadBatch", "uploads" : [], "sendpraat" : [ "praat" ] })
+    expect(reply.get("code") == 0 and reply.get("responses") == [], "no uploads: %s" % reply)
+    names = [ "/small.TextGrid?file=%d" % i for i in range(200) ]
+    reply = host.send({ "message" : "sendpraat", "sendpraat" : [ "praat" ] + [ "Read from file... " + check.url + name for name in names ] })
+    expect(reply.get("code") == 0, "download failed: %s" % reply.get("error"))
+    for path in glob.glob(os.path.join(check.cache, "*", "small.TextGrid"))[::2]:
+        with open(path, "ab") as file:
+            file.write(b"# edited\n")
+    uploads = [ { "uploadUrl" : check.url + "/upload", "fileParameter" : "uploadfile", "fileUrl" : check.url + name }
+                for name in names ]
+    reply = host.send({ "message" : "uploadBatch", "uploads" : uploads, "sendpraat" : [ "praat" ] })
+    host.close()
+    responses = reply.get("responses", [])
+    expect(reply.get("code") == 0 and len(responses) == len(names), "code %s, %d responses" % (reply.get("code"), len(responses)))
+    expect([ response.get("fileUrl") for response in responses ] == [ upload["fileUrl"] for upload in uploads ],
+           "responses out of order")
+    uploaded = [ response for response in responses if response.get("modified") is not False ]
+    expect(len(uploaded) == len(names) // 2 == len(check.server.uploads),
+           "%d of %d uploaded, %d received" % (len(uploaded), len(names), len(check.server.uploads)))
+
+CHECKS = {
+    "encodings": checkEncodings,
+    "resume": checkResume,
+    "range": checkRange,
+    "timeout": checkTimeout,
+    "exit-status": checkExitStatus,
+    "hedging": checkHedging,
+    "concurrency": checkConcurrency,
+    "shared-transfer": checkSharedTransfer,
+    "long-scripts": checkLongScripts,
+    "upload": checkUpload,
+    "unchanged-upload": checkUnchangedUpload,
+    "upload-batch": checkUploadBatch,
+    "memory-files": checkMemoryFiles,
+}
+
+def main():
+    if len(sys.argv) < 2:
+        print("Usage: %s path/to/websendpraat [check ...]\nChecks: %s" % (sys.argv[0], " ".join(CHECKS)))
+        return 2
+    names = sys.argv[2:] or list(CHECKS)
+    failed = 0
+    for name in names:
+        check = Check(sys.argv[1])
+        started = time.time()
+        try:
+            CHECKS[name](check)
+            print("ok      %-16s %.1fs" % (name, time.time() - started))
+        except (Failure, subprocess.TimeoutExpired) as failure:
+            print("FAILED  %-16s %s" % (name, failure))
+            failed += 1
+        finally:
+            check.close()
+    return 1 if failed else 0
+
+if __name__ == "__main__":
+    sys.exit(main())